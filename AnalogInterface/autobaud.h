@@ -0,0 +1,77 @@
+#pragma once
+#include "chillout.h"
+
+// Serial speed detection
+//
+// The compressor generations differ in speed, so rather than trust the
+// build, listen at each candidate rate in turn for DWELL_MS and lock
+// onto the first one at which the parser delimits LOCK_FRAMES
+// CRC-valid frames. Noise at the wrong rate can't realistically pass
+// the CRC, so a couple of frames is proof enough.
+//
+// A rate that has produced a valid frame isn't given up on until the
+// next one is overdue; status frames can be as far apart as
+// FRAME_GAP_MS, the same limit the comms timeout allows.
+//
+// If the link later goes quiet the search can be restarted.
+//
+namespace Autobaud
+{
+enum {
+    DWELL_MS = 500,             // time spent listening at each rate
+    LOCK_FRAMES = 2,            // valid frames needed to lock
+    FRAME_GAP_MS = 2000,        // longest believable status period
+};
+
+// candidate rates, the build's profile first
+const unsigned rates[] = {
+    Chillout::Profile::BAUD,
+    (Chillout::Profile::BAUD == Chillout::QuantumV3::BAUD) ? (unsigned)Chillout::Pro::BAUD : (unsigned)Chillout::QuantumV3::BAUD,
+};
+const unsigned num_rates = sizeof(rates) / sizeof(rates[0]);
+
+unsigned candidate;
+bool locked;
+unsigned started;               // uptime when the current rate was selected
+unsigned first_frame;           // Chillout::frames at that point
+
+// current rate
+unsigned
+rate()
+{
+    return rates[candidate];
+}
+
+// Start (or restart) the search at time now.
+//
+void
+restart(unsigned now)
+{
+    locked = false;
+    started = now;
+    first_frame = Chillout::frames;
+}
+
+// Called from the main loop; true if the UART should be switched to
+// rate().
+//
+bool
+poll(unsigned now)
+{
+    if (locked) {
+        return false;
+    }
+    if ((Chillout::frames - first_frame) >= LOCK_FRAMES) {
+        locked = true;
+        return false;
+    }
+    auto dwell = (Chillout::frames == first_frame) ? (unsigned)DWELL_MS : (unsigned)(DWELL_MS + FRAME_GAP_MS);
+    if ((now - started) >= dwell) {
+        candidate = (candidate + 1) % num_rates;
+        restart(now);
+        Chillout::parse_state = Chillout::WAIT_HEADER;
+        return true;
+    }
+    return false;
+}
+}
@@ -0,0 +1,143 @@
+#pragma once
+#include "input.h"
+
+// Controller range calibration
+//
+// Powering up with the controller knob at (or near) maximum arms a
+// calibration sweep: turn the knob to minimum, then back to maximum,
+// and leave it. The lowest and highest duty cycles seen are taken as
+// the controller's range once the knob has been back near the highest
+// for SETTLE_MS, provided the lowest was near the bottom of the scale.
+// Normal operation continues throughout; anything else (such as just
+// turning the knob down after powering up at max) is abandoned after
+// TIMEOUT_MS and nothing is changed. A normal power-up at max only
+// counts as sweeping() once the knob has actually reached the bottom.
+//
+// The result is kept in a flash page as a Record.
+//
+namespace Calibration
+{
+enum {
+    IDLE,
+    ARMED,                      // just powered up, watching for the entry condition
+    LEARNING,                   // sweep in progress
+    COMPLETE,                   // new range applied, waiting to be saved
+};
+
+enum {
+    ENTRY_DUTY = 85,            // duty cycle at power-up that starts a sweep
+    ENTRY_WINDOW_MS = 2000,     // ... if seen within this long
+    SETTLE_MS = 5000,           // sweep ends after this long back at the top
+    TIMEOUT_MS = 60000,         // ... or is abandoned after this long
+    MAX_LOW = 5,                // the bottom of the sweep must reach this
+    RETURN_SPAN = 3,            // "back at the top" is within this of the highest
+    MIN_SPAN = 50,              // minimum believable range
+};
+
+volatile unsigned state = ARMED;
+unsigned        elapsed;        // ms in the current state
+unsigned        at_top;         // ms back near high after reaching low
+volatile unsigned low;          // also read from the main loop by sweeping()
+unsigned        high;
+
+// Periodic timer callback; ms is the time since the last call.
+//
+void
+tick(unsigned ms, const Input::Measurement &m)
+{
+    elapsed += ms;
+
+    switch (state) {
+    case ARMED:
+        if ((m.signal == Input::SIGNAL_OK) && (m.duty_cycle >= ENTRY_DUTY)) {
+            state = LEARNING;
+            elapsed = 0;
+            at_top = 0;
+            low = m.duty_cycle;
+            high = m.duty_cycle;
+        } else if (elapsed >= ENTRY_WINDOW_MS) {
+            state = IDLE;
+        }
+        break;
+
+    case LEARNING:
+        if (m.signal == Input::SIGNAL_OK) {
+            if (m.duty_cycle < low) {
+                low = m.duty_cycle;
+            }
+            if (m.duty_cycle > high) {
+                high = m.duty_cycle;
+                at_top = 0;
+            }
+        }
+        if ((m.signal == Input::SIGNAL_OK) && (low <= MAX_LOW) && ((m.duty_cycle + RETURN_SPAN) >= high)) {
+            at_top += ms;
+        } else {
+            at_top = 0;
+        }
+        if ((at_top >= SETTLE_MS) && ((high - low) >= MIN_SPAN) && (low > 0)) {
+            Input::set_range(low, high);
+            state = COMPLETE;
+        } else if (elapsed >= TIMEOUT_MS) {
+            state = IDLE;
+        }
+        break;
+
+    default:
+        break;
+    }
+}
+
+// Has a sweep actually started, i.e. has the knob been turned down to
+// the bottom since arming?
+//
+bool
+sweeping()
+{
+    return (state == LEARNING) && (low <= MAX_LOW);
+}
+
+// Flash page image.
+//
+struct Record {
+    unsigned    magic;
+    unsigned    low;
+    unsigned    high;
+    unsigned    check;
+    unsigned    pad[12];
+};
+static_assert(sizeof(Record) == 64, "calibration record must fill exactly one flash page");
+
+enum {
+    MAGIC = 0x43414c31,         // 'CAL1'
+};
+
+Record
+record()
+{
+    Record r {};
+
+    r.magic = MAGIC;
+    r.low = Input::range_low;
+    r.high = Input::range_high;
+    r.check = ~(r.magic ^ r.low ^ r.high);
+    return r;
+}
+
+// Apply a stored record, if it looks valid.
+//
+bool
+load(const volatile Record &r)
+{
+    unsigned l = r.low;
+    unsigned h = r.high;
+
+    if ((r.magic != (unsigned)MAGIC) ||
+            (r.check != ~((unsigned)MAGIC ^ l ^ h)) ||
+            (l == 0) || (h > 100) || (h < (l + MIN_SPAN))) {
+        return false;
+    }
+    Input::set_range(l, h);
+    return true;
+}
+}
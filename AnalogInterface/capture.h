@@ -0,0 +1,94 @@
+#pragma once
+
+#include <sct.h>
+#include <interrupt.h>
+#include "defs.h"
+
+// SCT edge capture
+//
+// The SCT runs as a single unified 32-bit counter at 1MHz. Event 0
+// fires on a rising edge at CTIN_0 and latches the counter in CAP0,
+// event 1 fires on a falling edge and latches into CAP1. Both events
+// interrupt, so the ISR rate is twice the input frequency.
+//
+namespace Capture
+{
+enum {
+    EV_RISE = 0,
+    EV_FALL = 1,
+    PRESCALE = 24,              // 24MHz / 24 = 1MHz capture clock
+};
+
+void (*callback)(bool rising, unsigned timestamp);
+
+void
+init(unsigned pin_number, void (*handler)(bool rising, unsigned timestamp))
+{
+    callback = handler;
+
+    // clock on, out of reset
+    LPC_SYSCON->SYSAHBCLKCTRL |= (1U << 8);
+    LPC_SYSCON->PRESETCTRL &= ~(1U << 8);
+    LPC_SYSCON->PRESETCTRL |= (1U << 8);
+
+    // route the input pin to CTIN_0
+    LPC_SWM->PINASSIGN5 = (LPC_SWM->PINASSIGN5 & ~(0xffU << 24)) | (pin_number << 24);
+
+    // unified counter, CTIN_0 synchronised for edge detection
+    LPC_SCT->CONFIG = (1U << 0) | (1U << 9);
+    LPC_SCT->CTRL_L = (1U << 2) | (1U << 3) | ((PRESCALE - 1) << 5);
+
+    // event 0: rising edge on CTIN_0 -> CAP0
+    LPC_SCT->EVENT[EV_RISE].STATE = 1;
+    LPC_SCT->EVENT[EV_RISE].CTRL = (0U << 6) | (1U << 10) | (2U << 12);
+
+    // event 1: falling edge on CTIN_0 -> CAP1
+    LPC_SCT->EVENT[EV_FALL].STATE = 1;
+    LPC_SCT->EVENT[EV_FALL].CTRL = (0U << 6) | (2U << 10) | (2U << 12);
+
+    LPC_SCT->REGMODE_L = (1U << 0) | (1U << 1);
+    LPC_SCT->CAPCTRL[0].L = (1U << EV_RISE);
+    LPC_SCT->CAPCTRL[1].L = (1U << EV_FALL);
+
+    LPC_SCT->EVFLAG = (1U << EV_RISE) | (1U << EV_FALL);
+    LPC_SCT->EVEN = (1U << EV_RISE) | (1U << EV_FALL);
+    NVIC_SetPriority(SCT_IRQn, IRQ_PRIORITY);
+    NVIC_EnableIRQ(SCT_IRQn);
+
+    // and go
+    LPC_SCT->CTRL_L &= ~(1U << 2);
+}
+
+// current capture clock value
+unsigned
+now()
+{
+    return LPC_SCT->COUNT_U;
+}
+}
+
+extern "C" void
+SCT_IRQHandler()
+{
+    auto flags = LPC_SCT->EVFLAG & ((1U << Capture::EV_RISE) | (1U << Capture::EV_FALL));
+    LPC_SCT->EVFLAG = flags;
+
+    auto rise = LPC_SCT->CAP[0].U;
+    auto fall = LPC_SCT->CAP[1].U;
+
+    // If both edges were latched since the last interrupt, report them
+    // in the order they happened.
+    if (flags == ((1U << Capture::EV_RISE) | (1U << Capture::EV_FALL))) {
+        if ((int)(fall - rise) < 0) {
+            Capture::callback(false, fall);
+            Capture::callback(true, rise);
+        } else {
+            Capture::callback(true, rise);
+            Capture::callback(false, fall);
+        }
+    } else if (flags & (1U << Capture::EV_RISE)) {
+        Capture::callback(true, rise);
+    } else if (flags & (1U << Capture::EV_FALL)) {
+        Capture::callback(false, fall);
+    }
+}
@@ -2,7 +2,7 @@
 // ============================
 //
 // Interface is RS-485 @ 115200n81. Other units (pro, etc.) look to use a similar
-// protocol at 9600n81 but not yet verified / supported here.
+// protocol at 9600n81 but not yet verified; see the protocol profiles below.
 //
 // Circular connector pinout at the compressor unit (pin numbers are marked on the
 // remote cable connector face):
@@ -59,16 +59,92 @@
 namespace Chillout
 {
 // Bare-bones compressor protocol parser.
-// Limited sanity-checking, no attempt at CRC validation,
-// just enough so that we know what the compressor is doing.
+//
+// Framing is driven by the length byte, so frames from any address are
+// delimited and either handed to that address's handler or skipped as a
+// whole. Frames are CRC-checked; beyond that, just enough sanity-checking
+// so that we know what the compressor is doing.
+//
+enum {
+    HEADER          = 0xc0,
+    TRAILER         = 0x01,
+    MIN_LENGTH      = 0x04,         // LL for a frame with no payload
+    MAX_FRAME       = 32,           // longest frame we will delimit
+    PAYLOAD         = 3,            // offset of the first payload byte
+};
+
+// Protocol profiles
+//
+// Everything that differs between compressor models. One is chosen at
+// build time with CHILLOUT_PROFILE and the rest of the code (and
+// RS485) only refers to it as Profile, so a build carries just that
+// model's constants and command set.
+//
+struct QuantumV3 {
+    enum {
+        BAUD            = 115200,
+
+        ADDRESS_STATUS  = 1,        // compressor status
+        ADDRESS_AUX     = 2,        // compressor, unknown
+        ADDRESS_REMOTE  = 3,        // remote commands
+        MAX_ADDRESS     = 3,
+
+        STATUS_LENGTH   = 0x0e,     // LL of a status frame, and its field offsets
+        STATUS_MODE     = 0x03,
+        STATUS_SETPOINT = 0x06,
+        STATUS_COOLANT  = 0x07,
+        STATUS_RPM      = 0x0b,
+
+        COMMAND_LENGTH  = 0x08,     // LL of a remote command, and its field offsets
+        COMMAND_POWER   = 0x03,
+        COMMAND_SETPOINT = 0x05,
+        COMMAND_CHANGE  = 0x06,
+
+        POWER_OFF       = 0x00,
+        POWER_ECO       = 0x01,
+        POWER_MAX       = 0x03,
+    };
+
+    // CRC final XOR by sender address
+    static constexpr uint8_t crc_xor[MAX_ADDRESS + 1] = {
+        0x00,
+        0x30,                       // ADDRESS_STATUS
+        0xea,                       // ADDRESS_AUX
+        0xe9,                       // ADDRESS_REMOTE
+    };
+};
+
+// Chillout Pro etc.; reportedly the same frames at 9600bps, but the
+// layout is unverified.
+//
+struct Pro : QuantumV3 {
+    enum {
+        BAUD            = 9600,
+    };
+};
+
+#ifndef CHILLOUT_PROFILE
+# define CHILLOUT_PROFILE QuantumV3
+#endif
+
+typedef CHILLOUT_PROFILE Profile;
+
+// Frame offsets; parse_state is the offset of the next byte expected.
+enum {
+    WAIT_HEADER     = 0x00,
+    WAIT_LENGTH     = 0x01,
+    WAIT_ADDRESS    = 0x02,
+    WAIT_MODE       = Profile::STATUS_MODE,
+    WAIT_SETPOINT   = Profile::STATUS_SETPOINT,
+    WAIT_COOLANT    = Profile::STATUS_COOLANT,
+    WAIT_RPM        = Profile::STATUS_RPM,
+    WAIT_TRAILER    = Profile::STATUS_LENGTH,
+};
+
 enum {
-    RESET 			= -1,
-    WAIT_HEADER 	= 0x00,
-    WAIT_LENGTH 	= 0x01,
-    WAIT_ADDRESS 	= 0x02,
-    WAIT_MODE 		= 0x03,
-    WAIT_SETPOINT 	= 0x06,
-    WAIT_TRAILER 	= 0x0e,
+    ADDRESS_STATUS  = Profile::ADDRESS_STATUS,
+    ADDRESS_AUX     = Profile::ADDRESS_AUX,
+    ADDRESS_REMOTE  = Profile::ADDRESS_REMOTE,
 };
 
 enum {
@@ -76,65 +152,301 @@ enum {
     MODE_MAX        = 2,
 };
 
+// CRC-8, polynomial 0x07, zero initial value, no reflection, over the
+// payload bytes; the final XOR depends on the sender address.
+//
+// CRC_BITS selects the lookup table at compile time: 8 for a 256-byte
+// table (one lookup per byte) or 4 for a 16-byte nibble table (two
+// lookups per byte).
+//
+#ifndef CHILLOUT_CRC_BITS
+# define CHILLOUT_CRC_BITS 4
+#endif
+
+enum {
+    CRC_POLY        = 0x07,
+};
+
+template<unsigned BITS>
+struct CRC8 {
+    static_assert((BITS == 4) || (BITS == 8), "CRC table must be 4 or 8 bits");
+
+    struct Table {
+        uint8_t     entry[1U << BITS];
+    };
+
+    static constexpr Table
+    make_table()
+    {
+        Table t {};
+
+        for (auto i = 0U; i < (1U << BITS); i++) {
+            unsigned crc = i << (8 - BITS);
+            for (auto bit = 0U; bit < BITS; bit++) {
+                crc = (crc & 0x80) ? ((crc << 1) ^ CRC_POLY) : (crc << 1);
+            }
+            t.entry[i] = crc & 0xff;
+        }
+        return t;
+    }
+
+    static constexpr Table table = make_table();
+
+    static constexpr uint8_t
+    update(uint8_t crc, uint8_t c)
+    {
+        crc ^= c;
+        for (auto i = 0U; i < (8 / BITS); i++) {
+            crc = (crc << BITS) ^ table.entry[crc >> (8 - BITS)];
+        }
+        return crc;
+    }
+};
+
+constexpr uint8_t
+checksum(uint8_t address, const uint8_t *payload, unsigned length)
+{
+    uint8_t crc = 0;
+
+    while (length--) {
+        crc = CRC8<CHILLOUT_CRC_BITS>::update(crc, *payload++);
+    }
+    return crc ^ Profile::crc_xor[address];
+}
+
+unsigned crc_errors;
+unsigned frames;                    // CRC-valid frames from any address
+
+// Optionally told about every CRC-valid frame as it completes, with its
+// address and size in bytes.
+void (*frame_hook)(uint8_t address, unsigned bytes);
+
+struct Frame {
+    uint8_t         address;
+    const uint8_t   *payload;
+    unsigned        length;         // payload bytes
+    uint8_t         checksum;
+};
+
 int parse_state = WAIT_HEADER;
+uint8_t frame[MAX_FRAME];
+
+// compressor state
 uint8_t mode;
 uint8_t setting;
 
-// Bare-bones protocol parser
+// Everything else the compressor reports, as of the last valid status
+// frame.
+//
+struct Telemetry {
+    uint8_t         power;          // raw PP, including 0x02 (off-in-max)
+    uint8_t         setpoint;       // raw TT
+    int16_t         coolant;        // 1/100°C
+    uint16_t        rpm;
+    unsigned        timestamp;      // uptime when received
+    unsigned        frames;         // valid status frames received
+};
+
+Telemetry telemetry;
+
+// Time base for telemetry timestamps, in ms.
+//
+volatile unsigned uptime;
+
+void
+tick(unsigned ms)
+{
+    uptime += ms;
+}
+
+// last command seen from a remote
+uint8_t remote_mode;
+uint8_t remote_setting;
+
+// Address 1: compressor status
+//
+// PPxxxxTTCCCCxxxxRRRR
 //
 bool
-recv(unsigned c)
+status_frame(const Frame &f)
 {
-    switch (parse_state) {
+    auto m = f.payload[WAIT_MODE - PAYLOAD];
+    auto t = f.payload[WAIT_SETPOINT - PAYLOAD];
+
+    if ((f.length != (WAIT_TRAILER - PAYLOAD - 1)) ||
+            ((m & (MODE_ON | MODE_MAX)) != m) ||
+            (t < 1) || (t > 10)) {
+        return false;
+    }
+    mode = m;
+    setting = 11 - t;
+
+    telemetry.power = m;
+    telemetry.setpoint = t;
+    telemetry.coolant = (f.payload[WAIT_COOLANT - PAYLOAD] << 8) | f.payload[WAIT_COOLANT - PAYLOAD + 1];
+    telemetry.rpm = (f.payload[WAIT_RPM - PAYLOAD] << 8) | f.payload[WAIT_RPM - PAYLOAD + 1];
+    telemetry.timestamp = uptime;
+    telemetry.frames++;
+    return true;
+}
+
+// Address 3: remote command
+//
+// PPxxTTMM
+//
+bool
+remote_frame(const Frame &f)
+{
+    if (f.length != (Profile::COMMAND_LENGTH - MIN_LENGTH)) {
+        return false;
+    }
+    remote_mode = f.payload[Profile::COMMAND_POWER - PAYLOAD];
+    remote_setting = f.payload[Profile::COMMAND_SETPOINT - PAYLOAD];
+    return false;
+}
+
+typedef bool (*Handler)(const Frame &f);
+
+// Handlers by address; addresses without one are skipped.
+//
+struct HandlerTable {
+    Handler     entry[Profile::MAX_ADDRESS + 1];
+
+    constexpr Handler operator[](unsigned i) const { return entry[i]; }
+};
+
+constexpr HandlerTable
+make_handlers()
+{
+    HandlerTable t {};
+
+    t.entry[ADDRESS_STATUS] = status_frame;
+    t.entry[ADDRESS_REMOTE] = remote_frame;
+    return t;
+}
+
+constexpr HandlerTable handlers = make_handlers();
+const unsigned max_address = Profile::MAX_ADDRESS;
+
+// Hand a complete frame to its handler; true if it was a valid
+// compressor status frame.
+//
+bool
+dispatch()
+{
+    auto handler = handlers[frame[WAIT_ADDRESS]];
+
+    if (handler == nullptr) {
+        return false;
+    }
+
+    Frame f;
+    f.address = frame[WAIT_ADDRESS];
+    f.payload = &frame[PAYLOAD];
+    f.length = frame[WAIT_LENGTH] - MIN_LENGTH;
+    f.checksum = frame[frame[WAIT_LENGTH] - 1];
+    return handler(f);
+}
+
+// Check the byte at frame[offset] against what we know of the frame
+// so far.
+//
+enum {
+    BYTE_OK,
+    BYTE_BAD,
+    FRAME_COMPLETE,
+};
+
+unsigned
+check(unsigned offset)
+{
+    auto c = frame[offset];
+
+    switch (offset) {
     case WAIT_HEADER:
-        if (c != 0xc0) {
-            parse_state = RESET;
-        }
-        break;
+        return (c == HEADER) ? BYTE_OK : BYTE_BAD;
 
     case WAIT_LENGTH:
-        if (c != 0x0e) {
-            parse_state = RESET;
-        }
-        break;
+        return ((c >= MIN_LENGTH) && (c < MAX_FRAME)) ? BYTE_OK : BYTE_BAD;
 
     case WAIT_ADDRESS:
-        if (c != 0x01) {
-            parse_state = RESET;
-        }
-        break;
+        return ((c >= 1) && (c <= max_address)) ? BYTE_OK : BYTE_BAD;
 
-    case WAIT_MODE:
-    	if ((c & (MODE_ON | MODE_MAX)) != c) {
-    		parse_state = RESET;
-    	} else {
-        	mode = c;
+    default:
+        if (offset == frame[WAIT_LENGTH]) {
+            if (c != TRAILER) {
+                return BYTE_BAD;
+            }
+            if (frame[offset - 1] != checksum(frame[WAIT_ADDRESS], &frame[PAYLOAD], offset - MIN_LENGTH)) {
+                crc_errors++;
+                return BYTE_BAD;
+            }
+            frames++;
+            return FRAME_COMPLETE;
         }
-        break;
+        return BYTE_OK;
+    }
+}
 
-    case WAIT_SETPOINT:
-        if ((c < 1) || (c >> 0x0a)) {
-            parse_state = RESET;
-        } else {
-            setting = 11 - c;
-        }
-        break;
+// Drop the first n buffered bytes.
+//
+void
+discard(unsigned n, unsigned &buffered)
+{
+    for (auto i = n; i < buffered; i++) {
+        frame[i - n] = frame[i];
+    }
+    buffered -= n;
+}
 
-    case WAIT_TRAILER:
-    	if (c != 0x01) {
-    		parse_state = RESET;
-    	} else {
-        	parse_state = WAIT_HEADER;
-        	return true;
-        }
-        break;
+// Feed one received byte to the parser; true if it completed a
+// compressor status frame.
+//
+// When framing fails the byte isn't simply dropped; the buffer is
+// rescanned from the byte after the failed header, so a header inside
+// a truncated frame (or the failing byte itself) starts the next frame
+// and nothing after the truncation is lost.
+//
+bool
+recv(unsigned c)
+{
+    auto status = false;
+    auto offset = (unsigned)parse_state;
+    auto buffered = offset;
 
-    default:
-        break;
+    frame[buffered++] = c;
+
+    while (offset < buffered) {
+        switch (check(offset)) {
+        case BYTE_OK:
+            offset++;
+            break;
+
+        case FRAME_COMPLETE:
+            if (frame_hook) {
+                frame_hook(frame[WAIT_ADDRESS], offset + 1);
+            }
+            if (dispatch()) {
+                status = true;
+            }
+            discard(offset + 1, buffered);
+            offset = 0;
+            break;
+
+        case BYTE_BAD: {
+            auto next = 1U;
+            while ((next < buffered) && (frame[next] != HEADER)) {
+                next++;
+            }
+            discard(next, buffered);
+            offset = 0;
+            break;
+        }
+        }
     }
 
-    parse_state++;
-    return false;
+    parse_state = buffered;
+    return status;
 }
 
 enum {
@@ -143,29 +455,105 @@ enum {
     SET_NONE = 1000,
 };
 
+// Remote command payload fields
+//
+enum {
+    POWER_OFF       = Profile::POWER_OFF,
+    POWER_ECO       = Profile::POWER_ECO,
+    POWER_MAX       = Profile::POWER_MAX,
+};
+
+enum {
+    CHANGE_POWER    = 0x00,
+    CHANGE_SETPOINT = 0x01,
+};
+
+#ifndef CHILLOUT_POWER
+# define CHILLOUT_POWER POWER_MAX   // power mode used when switching on
+#endif
+
 struct Command {
-    uint8_t bytes[9];
+    uint8_t bytes[Profile::COMMAND_LENGTH + 1];
 };
 
-// Table of useful commands.
-// Much simpler / cheaper than the CRC algorithm
-// necessary to generate and send arbitrary packets.
+// Build a remote command frame. This is constexpr so that commands are
+// generated (and CRC'd) by the compiler; only those actually referenced
+// end up in flash.
+//
+constexpr Command
+make_command(uint8_t power, uint8_t setpoint, uint8_t change)
+{
+    Command c {};
+
+    c.bytes[WAIT_HEADER] = HEADER;
+    c.bytes[WAIT_LENGTH] = Profile::COMMAND_LENGTH;
+    c.bytes[WAIT_ADDRESS] = ADDRESS_REMOTE;
+    c.bytes[Profile::COMMAND_POWER] = power;
+    c.bytes[Profile::COMMAND_SETPOINT] = setpoint;
+    c.bytes[Profile::COMMAND_CHANGE] = change;
+    c.bytes[Profile::COMMAND_LENGTH - 1] = checksum(ADDRESS_REMOTE, &c.bytes[PAYLOAD], Profile::COMMAND_LENGTH - MIN_LENGTH);
+    c.bytes[Profile::COMMAND_LENGTH] = TRAILER;
+    return c;
+}
+
+template<uint8_t POWER, uint8_t SETPOINT, uint8_t CHANGE = CHANGE_SETPOINT>
+constexpr Command command = make_command(POWER, SETPOINT, CHANGE);
+
+// Table of the commands update_command() chooses from: off, on, then
+// one per setting from least to most cooling.
 //
-const Command cmd_table[] = {
-    { .bytes = {0xc0, 0x08, 0x03, 0x00, 0x00, 0x0a, 0x00, 0x6b, 0x01} }, // off
-    { .bytes = {0xc0, 0x08, 0x03, 0x03, 0x00, 0x0a, 0x00, 0x51, 0x01} }, // on max
-    { .bytes = {0xc0, 0x08, 0x03, 0x03, 0x00, 0x0a, 0x01, 0x56, 0x01} }, // least cooling
-    { .bytes = {0xc0, 0x08, 0x03, 0x03, 0x00, 0x09, 0x01, 0x69, 0x01} }, // ...
-    { .bytes = {0xc0, 0x08, 0x03, 0x03, 0x00, 0x08, 0x01, 0x7c, 0x01} },
-    { .bytes = {0xc0, 0x08, 0x03, 0x03, 0x00, 0x07, 0x01, 0xbf, 0x01} },
-    { .bytes = {0xc0, 0x08, 0x03, 0x03, 0x00, 0x06, 0x01, 0xaa, 0x01} },
-    { .bytes = {0xc0, 0x08, 0x03, 0x03, 0x00, 0x05, 0x01, 0x95, 0x01} },
-    { .bytes = {0xc0, 0x08, 0x03, 0x03, 0x00, 0x04, 0x01, 0x80, 0x01} },
-    { .bytes = {0xc0, 0x08, 0x03, 0x03, 0x00, 0x03, 0x01, 0xeb, 0x01} },
-    { .bytes = {0xc0, 0x08, 0x03, 0x03, 0x00, 0x02, 0x01, 0xfe, 0x01} },
-    { .bytes = {0xc0, 0x08, 0x03, 0x03, 0x00, 0x01, 0x01, 0xc1, 0x01} }, // most cooling
+struct CommandTable {
+    Command     entry[SET_ON + Input::MAX + 1];
+
+    constexpr const Command &operator[](unsigned i) const { return entry[i]; }
 };
 
+constexpr CommandTable
+make_cmd_table(uint8_t power)
+{
+    CommandTable t {};
+
+    t.entry[SET_OFF] = make_command(POWER_OFF, Input::MAX, CHANGE_POWER);
+    t.entry[SET_ON] = make_command(power, Input::MAX, CHANGE_POWER);
+    for (unsigned s = Input::MIN; s <= Input::MAX; s++) {
+        t.entry[SET_ON + s] = make_command(power, Input::MAX + 1 - s, CHANGE_SETPOINT);
+    }
+    return t;
+}
+
+constexpr CommandTable cmd_table = make_cmd_table(CHILLOUT_POWER);
+
+// Commands are either sent straight from cmd_table (flash) or built on
+// demand into a RAM buffer. Building reuses the receive CRC table, but
+// the builder code is about as big as the table it replaces and costs
+// RAM besides, so the table stays the default; cmd_table isn't emitted
+// at all when building is selected here.
+//
+#ifndef CHILLOUT_COMMAND_TABLE
+# define CHILLOUT_COMMAND_TABLE 1
+#endif
+
+#if !CHILLOUT_COMMAND_TABLE
+Command command_buffer;
+
+// Build cmd_table[cmd] into command_buffer.
+//
+const Command *
+build_command(unsigned cmd)
+{
+    uint8_t power = (cmd == SET_OFF) ? POWER_OFF : CHILLOUT_POWER;
+    uint8_t setpoint = Input::MAX;
+    uint8_t change = CHANGE_POWER;
+
+    if (cmd > SET_ON) {
+        setpoint = Input::MAX + 1 + SET_ON - cmd;
+        change = CHANGE_SETPOINT;
+    }
+    command_buffer = make_command(power, setpoint, change);
+    return &command_buffer;
+}
+#endif
+
 // Send compressor commands to adjust state to match target.
 // Prioritise on/off commands over power settings.
 //
@@ -190,13 +578,24 @@ update_index(uint8_t target_setting)
     return cmd;
 }
 
+// Command for an update_index() result.
+//
 const Command *
-update_command(uint8_t target_setting)
+command_for(unsigned cmd)
 {
-	auto cmd = update_index(target_setting);
     if (cmd != SET_NONE) {
+#if CHILLOUT_COMMAND_TABLE
         return &cmd_table[cmd];
+#else
+        return build_command(cmd);
+#endif
     }
     return nullptr;
 }
+
+const Command *
+update_command(uint8_t target_setting)
+{
+    return command_for(update_index(target_setting));
+}
 }
\ No newline at end of file
@@ -0,0 +1,94 @@
+#pragma once
+#include "chillout.h"
+
+// Command pacing
+//
+// The compressor takes a while to act on a command, and until it does
+// every status frame still disagrees with the target. Rather than
+// resend on every frame, remember the outstanding command and what it
+// should do to the reported state. The same command isn't repeated
+// until SETTLE_MS has passed, then only at doubling intervals up to
+// MAX_BACKOFF_MS, while the state fails to converge. A different
+// command (the target moved, or the last one took effect and the next
+// step is needed) goes out straight away.
+//
+// next() only picks the command; nothing is recorded until sent() says
+// it actually went out on the bus. A command that was superseded, never
+// found a gap or was given up on after collisions is still due, and is
+// offered again on the next status frame.
+//
+#ifndef COMMAND_SETTLE_MS
+# define COMMAND_SETTLE_MS 2000
+#endif
+
+namespace Commander
+{
+enum {
+    SETTLE_MS = COMMAND_SETTLE_MS,
+    MAX_BACKOFF_MS = 8 * SETTLE_MS,
+};
+
+unsigned chosen = Chillout::SET_NONE;      // command last returned by next()
+unsigned outstanding = Chillout::SET_NONE; // command last seen to go out
+unsigned sent_at;               // uptime when outstanding was last sent
+unsigned hold_off;              // ... and how long before repeating it
+unsigned acked;                 // commands seen to take effect
+unsigned retries;               // repeats of an unacknowledged command
+
+// Has the compressor done what cmd asked?
+//
+bool
+converged(unsigned cmd)
+{
+    switch (cmd) {
+    case Chillout::SET_OFF:
+        return !(Chillout::mode & Chillout::MODE_ON);
+    case Chillout::SET_ON:
+        return Chillout::mode & Chillout::MODE_ON;
+    default:
+        return Chillout::setting == (cmd - Chillout::SET_ON);
+    }
+}
+
+// Called for each status frame; the command to send now, if any.
+//
+const Chillout::Command *
+next(uint8_t target_setting, unsigned now)
+{
+    chosen = Chillout::SET_NONE;
+    if ((outstanding != Chillout::SET_NONE) && converged(outstanding)) {
+        acked++;
+        outstanding = Chillout::SET_NONE;
+    }
+
+    auto cmd = Chillout::update_index(target_setting);
+    if (cmd == Chillout::SET_NONE) {
+        outstanding = Chillout::SET_NONE;
+        return nullptr;
+    }
+
+    if ((cmd == outstanding) && ((now - sent_at) < hold_off)) {
+        return nullptr;
+    }
+    chosen = cmd;
+    return Chillout::command_for(cmd);
+}
+
+// Called once cmd (as chosen by next()) has been completely sent.
+//
+void
+sent(unsigned cmd, unsigned now)
+{
+    if (cmd == Chillout::SET_NONE) {
+        return;
+    }
+    if (cmd == outstanding) {
+        retries++;
+        hold_off = (hold_off >= (MAX_BACKOFF_MS / 2)) ? (unsigned)MAX_BACKOFF_MS : (hold_off * 2);
+    } else {
+        outstanding = cmd;
+        hold_off = SETTLE_MS;
+    }
+    sent_at = now;
+}
+}
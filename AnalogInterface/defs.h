@@ -2,3 +2,7 @@
 
 #define USEC(_n)    ((24U * _n) - 1)
 #define MSEC(_n)    ((24000U * _n) - 1)
+
+// Every interrupt runs at this one priority, so none preempts another;
+// see Input::read().
+#define IRQ_PRIORITY    1
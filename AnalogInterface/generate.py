@@ -2,6 +2,9 @@
 #
 # Generate pre-crc'ed command payloads
 #
+# chillout.h now builds these at compile time; test.cpp checks its
+# output against what this prints.
+#
 
 import crccheck
 
@@ -32,3 +35,6 @@ gen_pkt("set 7", b'\x03\x00\x07\x01')
 gen_pkt("set 8", b'\x03\x00\x08\x01')
 gen_pkt("set 9", b'\x03\x00\x09\x01')
 gen_pkt("set 10", b'\x03\x00\x0a\x01')
+gen_pkt("eco", b'\x01\x00\x0a\x00')
+gen_pkt("eco set 1", b'\x01\x00\x01\x01')
+gen_pkt("eco set 10", b'\x01\x00\x0a\x01')
@@ -0,0 +1,71 @@
+#pragma once
+
+// In-application flash programming via the LPC8xx boot ROM.
+//
+// The ROM uses the top 32 bytes of RAM, and flash is not readable while
+// it runs, so interrupts are held off for the duration of each call.
+// The stack starts at the top of RAM, so whatever the outermost frames
+// keep there is saved around each call and put back afterwards. The
+// buffers used for that and for the ROM's arguments are static rather
+// than on the stack, which (if call() is inlined into main) could put
+// them in the very area the ROM overwrites.
+//
+namespace IAP
+{
+enum {
+    PREPARE         = 50,
+    COPY_RAM        = 51,
+    ERASE_PAGE      = 59,
+    CMD_SUCCESS     = 0,
+    PAGE_SIZE       = 64,
+    SECTOR_SIZE     = 1024,
+    CCLK_KHZ        = 24000,
+    RAM_TOP         = 0x10000400,   // LPC810: 1kB from 0x10000000
+    ROM_RAM_WORDS   = 32 / 4,       // used by the ROM below RAM_TOP
+};
+
+typedef void (*Entry)(unsigned *command, unsigned *result);
+
+bool
+call(unsigned cmd, unsigned p0, unsigned p1, unsigned p2 = 0, unsigned p3 = 0)
+{
+    static unsigned command[5];
+    static unsigned result[4];
+    static unsigned saved[ROM_RAM_WORDS];
+    auto top = (volatile unsigned *)RAM_TOP - ROM_RAM_WORDS;
+
+    command[0] = cmd;
+    command[1] = p0;
+    command[2] = p1;
+    command[3] = p2;
+    command[4] = p3;
+
+    __disable_irq();
+    for (auto i = 0U; i < ROM_RAM_WORDS; i++) {
+        saved[i] = top[i];
+    }
+    ((Entry)0x1fff1ff1)(command, result);
+    for (auto i = 0U; i < ROM_RAM_WORDS; i++) {
+        top[i] = saved[i];
+    }
+    __enable_irq();
+
+    return result[0] == CMD_SUCCESS;
+}
+
+// Replace one (page-aligned) flash page with PAGE_SIZE bytes from
+// (word-aligned) RAM.
+//
+bool
+write_page(const volatile void *flash, const void *ram)
+{
+    auto address = (unsigned)flash;
+    auto sector = address / SECTOR_SIZE;
+    auto page = address / PAGE_SIZE;
+
+    return call(PREPARE, sector, sector)
+           && call(ERASE_PAGE, page, page, CCLK_KHZ)
+           && call(PREPARE, sector, sector)
+           && call(COPY_RAM, address, (unsigned)ram, PAGE_SIZE, CCLK_KHZ);
+}
+}
@@ -10,55 +10,636 @@ enum {
     MAX = 10,
 };
 
-// current / next state tracking
-unsigned        current_target = OFF;
-const unsigned  windows[MAX + 1][2] = {
-    {0, 1},
-    {2, 18},
-    {15, 34},
-    {31, 48},
-    {45, 60},
-    {58, 71},
-    {69, 80},
-    {79, 88},
-    {86, 93},
-    {92, 98},
-    {97, 100}
+// Duty cycle -> cooling level windows
+//
+// The CoolShirt controller's knob position (0..100%) maps to PWM duty
+// cycle along the quadratic fit in notes.txt. Knob travel is divided
+// into MAX equal bins, each widened by HYSTERESIS percent of travel at
+// either end, and the bin edges are evaluated on the curve. Window 0
+// (OFF) is everything at or below OFF_DUTY.
+//
+// Each window is {step down if lower, step up if higher}.
+//
+enum {
+    HYSTERESIS = 1,             // percent of knob travel
+    OFF_DUTY = 1,               // highest duty cycle that means OFF
+};
+
+constexpr unsigned
+curve(int point)
+{
+    if (point < 0) {
+        point = 0;
+    }
+    if (point > 100) {
+        point = 100;
+    }
+    auto duty = -0.8285714 + 1.846286 * point - 0.008342857 * point * point;
+    return (duty < 0) ? 0 : (unsigned)duty;
+}
+
+struct Windows {
+    unsigned window[MAX + 1][2];
+
+    constexpr const unsigned (&operator[](unsigned level) const)[2]
+    {
+        return window[level];
+    }
+};
+
+constexpr Windows
+make_windows()
+{
+    Windows w {};
+
+    w.window[OFF][0] = 0;
+    w.window[OFF][1] = OFF_DUTY;
+
+    for (auto level = (unsigned)MIN; level <= MAX; level++) {
+        auto bin = level - MIN;
+        auto low_point = (bin == 0) ? 0 : (int)((bin * 100.0 / MAX) - HYSTERESIS);
+        auto high_point = (int)(((bin + 1) * 100.0 / MAX) + HYSTERESIS);
+
+        w.window[level][0] = (level == MIN) ? (OFF_DUTY + 1) : curve(low_point);
+        w.window[level][1] = curve(high_point);
+    }
+    return w;
+}
+
+constexpr Windows windows = make_windows();
+
+constexpr bool
+windows_valid()
+{
+    if ((windows[OFF][0] != 0) || (windows[MAX][1] != 100)) {
+        return false;
+    }
+    for (auto level = 0U; level <= MAX; level++) {
+        if (windows[level][0] > windows[level][1]) {
+            return false;
+        }
+        if (level < MAX) {
+            // monotonic
+            if ((windows[level + 1][0] <= windows[level][0]) ||
+                    (windows[level + 1][1] <= windows[level][1])) {
+                return false;
+            }
+            // no gaps
+            if (windows[level + 1][0] > (windows[level][1] + 1)) {
+                return false;
+            }
+        }
+        if (level < (MAX - 1)) {
+            // overlaps only with neighbours
+            if (windows[level + 2][0] <= windows[level][1]) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+static_assert(windows_valid(), "input windows must be monotonic, gap-free and overlap only neighbours");
+
+// Controller range
+//
+// The windows assume the knob's minimum reads CURVE_LOW and its maximum
+// CURVE_HIGH. A calibrated controller that reads range_low..range_high
+// instead is mapped piecewise-linearly back onto that range before
+// resolving, which is equivalent to rescaling the windows without
+// rebuilding the table.
+//
+enum {
+    CURVE_LOW = OFF_DUTY + 1,
+    CURVE_HIGH = 100,
+};
+
+unsigned        range_low = CURVE_LOW;
+unsigned        range_high = CURVE_HIGH;
+bool            rescaled;       // range changed since the last resolve
+
+void
+set_range(unsigned low, unsigned high)
+{
+    range_low = low;
+    range_high = high;
+    rescaled = true;
+}
+
+unsigned
+scale(unsigned duty)
+{
+    if ((range_low == CURVE_LOW) && (range_high == CURVE_HIGH)) {
+        return duty;
+    }
+    if (duty >= range_high) {
+        return CURVE_HIGH;
+    }
+    if (duty <= range_low) {
+        return (duty * CURVE_LOW + range_low / 2) / range_low;
+    }
+    return CURVE_LOW + ((duty - range_low) * (CURVE_HIGH - CURVE_LOW) + (range_high - range_low) / 2) /
+           (range_high - range_low);
+}
+
+// current / next state tracking; written only from tick()
+volatile unsigned current_target = OFF;
+
+// Input signal health
+//
+// A connected controller always produces edges, except at 100% duty
+// cycle where the input is static high. A static low input means the
+// controller is unplugged or switched off; periods outside MIN_HZ..MAX_HZ
+// mean the input is not a controller we understand.
+//
+enum {
+    SIGNAL_OK,
+    SIGNAL_LOST,                // static low input
+    SIGNAL_FREQUENCY,           // PWM frequency out of range
+};
+
+enum {
+    NOMINAL_HZ = 40,
+    MIN_HZ = 30,
+    MAX_HZ = 50,
+    MIN_PERIOD = 1000000 / MAX_HZ,
+    MAX_PERIOD = 1000000 / MIN_HZ,
+};
+
+// ISR -> main loop measurement snapshot
+//
+// The estimator runs in interrupt context and publishes the duty cycle
+// and signal state together, with a generation number that increments
+// whenever either of them changes. sequence is odd while an update is
+// in progress; a reader that sees it change under it retries.
+//
+// read() is also called from the timer tick, which is only safe because
+// the tick can't preempt the capture interrupt in the middle of
+// publish() (it would spin forever); the firmware runs every interrupt
+// at the same priority to guarantee that.
+//
+struct Measurement {
+    unsigned    duty_cycle;
+    unsigned    signal;
+    unsigned    generation;
+};
+
+volatile unsigned       sequence;
+volatile Measurement    measurement = {0, SIGNAL_LOST, 0};
+
+void
+publish(unsigned duty_cycle, unsigned signal)
+{
+    // nothing new; e.g. a static input at 0 or 100%
+    if ((duty_cycle == measurement.duty_cycle) && (signal == measurement.signal)) {
+        return;
+    }
+
+    sequence = sequence + 1;
+    measurement.duty_cycle = duty_cycle;
+    measurement.signal = signal;
+    measurement.generation = measurement.generation + 1;
+    sequence = sequence + 1;
+}
+
+Measurement
+read()
+{
+    for (;;) {
+        auto start = sequence;
+        Measurement m = {measurement.duty_cycle, measurement.signal, measurement.generation};
+        if (!(start & 1) && (sequence == start)) {
+            return m;
+        }
+    }
+}
+
+// Period-synchronous duty cycle estimator
+//
+// Both input paths deliver whole PWM periods (high time and length,
+// in microseconds, closed at each rising edge). The duty cycle is the
+// ratio of the sums over the last AVERAGE_PERIODS periods, so the
+// averaging window always spans whole periods and doesn't beat against
+// the input frequency.
+//
+enum {
+    AVERAGE_PERIODS = 2,        // periods averaged into the duty cycle
+    STATIC_TIMEOUT = 2 * 1000000 / NOMINAL_HZ,  // us without an edge before the input is considered static
+};
+
+unsigned        period_high[AVERAGE_PERIODS];
+unsigned        period_length[AVERAGE_PERIODS];
+unsigned        period_index;
+unsigned        period_count;
+
+void
+period(unsigned high, unsigned length)
+{
+    period_high[period_index] = high;
+    period_length[period_index] = length;
+    if (++period_index >= AVERAGE_PERIODS) {
+        period_index = 0;
+    }
+    if (period_count < AVERAGE_PERIODS) {
+        period_count++;
+    }
+
+    auto sum_high = 0U;
+    auto sum_length = 0U;
+    for (auto i = 0U; i < period_count; i++) {
+        sum_high += period_high[i];
+        sum_length += period_length[i];
+    }
+    if (sum_length > 0) {
+        publish((sum_high * 100 + sum_length / 2) / sum_length,
+                ((length < MIN_PERIOD) || (length > MAX_PERIOD)) ? SIGNAL_FREQUENCY : SIGNAL_OK);
+    }
+}
+
+// No edges for a while; the input is static at 0 or 100%.
+//
+void
+static_input(bool pin_state)
+{
+    publish(pin_state ? 100 : 0, pin_state ? SIGNAL_OK : SIGNAL_LOST);
+    period_count = 0;
+    period_index = 0;
+}
+
+// polled sampling state
+enum {
+    SAMPLE_US = 1000,           // sample interval
 };
 
-volatile unsigned duty_cycle;
 volatile unsigned samples;
 volatile unsigned count;
+bool            last_state;
+bool            period_started;
+
+// Glitch rejection
+//
+// Pulses (high or low) shorter than GLITCH_US are noise. The edge
+// capture path drops both edges of such a pulse. The polled paths can't
+// see anything shorter than a sample, so they only filter when
+// GLITCH_US is at least a whole sample: then they take the majority of
+// the last three samples, which rejects single-sample pulses at the
+// cost of one sample of delay. That also removes a real one-sample
+// pulse, i.e. the bottom and top few percent of duty cycle at 1ms, so
+// it's off at the default GLITCH_US.
+//
+#ifndef INPUT_GLITCH_US
+# define INPUT_GLITCH_US 100
+#endif
+
+enum {
+    GLITCH_US = INPUT_GLITCH_US,
+    GLITCH_SAMPLES = GLITCH_US / SAMPLE_US,
+};
+static_assert(GLITCH_SAMPLES <= 1, "polled glitch filter only rejects single-sample pulses");
+
+unsigned        raw_history;    // unfiltered samples, newest in bit 0
 
-// 1ms timer callback, samples input 500 time and updates
-// duty_cycle accordingly.
+// 1ms timer callback, samples input and closes a period at
+// each rising edge.
 //
 void
 sample(bool pin_state)
 {
+    if (GLITCH_SAMPLES > 0) {
+        raw_history = (raw_history << 1) | (pin_state ? 1U : 0U);
+        pin_state = __builtin_popcount(raw_history & 7) >= 2;
+    }
+
+    if (pin_state && !last_state) {
+        if (period_started) {
+            period(count * SAMPLE_US, samples * SAMPLE_US);
+        }
+        period_started = true;
+        count = 0;
+        samples = 0;
+    }
+    last_state = pin_state;
 
     if (pin_state) {
         count++;
     }
-    if (samples++ >= 500) {
-        duty_cycle = count / 5;
+    if (++samples >= (STATIC_TIMEOUT / SAMPLE_US)) {
+        static_input(pin_state);
+        period_started = false;
+        count = 0;
+        samples = 0;
+    }
+}
+
+// Bit-packed polled sampling
+//
+// The per-tick work is a shift, an increment and a compare; every 32
+// samples the packed bits are processed in one go, using popcount for
+// the high time and the rising-edge mask to split them at period
+// boundaries. If the pending bits have no rising edge and would take
+// the input past STATIC_TIMEOUT they are processed straight away, so a
+// static input is reported on the same sample as sample() would.
+//
+unsigned        sample_bits;
+unsigned        sample_bit_count;
+bool            sample_rising;  // a pending bit is a (raw) rising edge
+
+// Process the low bits samples of word, oldest first.
+//
+void
+sample_word(unsigned word, unsigned bits = 32)
+{
+    auto valid = (bits < 32) ? ((1U << bits) - 1) : ~0U;
+
+    word &= valid;
+    if (GLITCH_SAMPLES > 0) {
+        // bit-parallel majority of each sample and its two predecessors
+        auto p = (word >> 1) | (raw_history << (bits - 1));
+        auto pp = (word >> 2) | ((bits >= 2) ? (raw_history << (bits - 2)) : (raw_history >> 1));
+        raw_history = (bits >= 2) ? word : ((raw_history << 1) | word);
+        word = ((word & p) | (word & pp) | (p & pp)) & valid;
+    }
+
+    // Bit (bits - 1) is the oldest sample; a rising edge is a high sample
+    // whose predecessor was low.
+    auto previous = (word >> 1) | ((last_state ? 1U : 0U) << (bits - 1));
+    auto rising = word & ~previous;
+    auto remaining = bits;
+
+    while (rising) {
+        auto position = 31U - __builtin_clz(rising);
+        auto before = remaining - 1 - position;
+        auto mask = ((1U << before) - 1) << (position + 1);
+
+        count += __builtin_popcount(word & mask);
+        samples += before;
+        if (period_started) {
+            period(count * SAMPLE_US, samples * SAMPLE_US);
+        }
+        period_started = true;
+        count = 0;
+        samples = 0;
+
+        remaining = position + 1;
+        rising &= ~(1U << position);
+    }
+
+    auto mask = (remaining < 32) ? ((1U << remaining) - 1) : ~0U;
+    count += __builtin_popcount(word & mask);
+    samples += remaining;
+    last_state = word & 1;
+
+    if (samples >= (STATIC_TIMEOUT / SAMPLE_US)) {
+        static_input(last_state);
+        period_started = false;
         count = 0;
         samples = 0;
     }
 }
 
-// map duty cycle to 0-10 target cooling level
+// 1ms timer callback, packed equivalent of sample().
+//
+void
+sample_packed(bool pin_state)
+{
+    if (pin_state && !(sample_bits & 1)) {
+        sample_rising = true;
+    }
+    sample_bits = (sample_bits << 1) | (pin_state ? 1U : 0U);
+    sample_bit_count++;
+    if ((sample_bit_count >= 32) ||
+            (!sample_rising && ((samples + sample_bit_count) >= (STATIC_TIMEOUT / SAMPLE_US)))) {
+        sample_word(sample_bits, sample_bit_count);
+        sample_bit_count = 0;
+
+        // the glitch filter delays a rise in the last sample to the next
+        sample_rising = (GLITCH_SAMPLES > 0) && ((sample_bits & 3) == 1);
+    }
+}
+
+// edge capture state
+unsigned        pending_time;
+bool            pending_rising;
+bool            pending_valid;
+unsigned        last_rise;
+unsigned        last_fall;
+unsigned        last_edge;
+bool            rise_valid;
+bool            fall_valid;
+
+// Accept a filtered edge.
+//
+void
+commit_edge(bool rising, unsigned timestamp)
+{
+    last_edge = timestamp;
+
+    if (rising) {
+        if (rise_valid && fall_valid) {
+            auto length = timestamp - last_rise;
+            auto high = last_fall - last_rise;
+
+            if ((length > 0) && (high <= length)) {
+                period(high, length);
+            }
+        }
+        last_rise = timestamp;
+        rise_valid = true;
+        fall_valid = false;
+    } else if (rise_valid) {
+        last_fall = timestamp;
+        fall_valid = true;
+    }
+}
+
+// Edge capture callback; timestamp is a free-running 1MHz counter
+// value latched by the capture hardware.
+//
+// Each edge is held until the next one arrives (or a timer tick finds
+// it old enough); if the two bound a pulse shorter than GLITCH_US both
+// are dropped.
+//
+void
+edge(bool rising, unsigned timestamp)
+{
+    if (pending_valid) {
+        if ((rising != pending_rising) && ((timestamp - pending_time) < GLITCH_US)) {
+            pending_valid = false;
+            return;
+        }
+        commit_edge(pending_rising, pending_time);
+    }
+    pending_rising = rising;
+    pending_time = timestamp;
+    pending_valid = true;
+}
+
+// Timer callback for the edge capture path; now is the current
+// capture clock value. With no edges for STATIC_TIMEOUT the input
+// is static.
+//
+void
+capture_tick(bool pin_state, unsigned now)
+{
+    if (pending_valid && ((now - pending_time) >= GLITCH_US)) {
+        commit_edge(pending_rising, pending_time);
+        pending_valid = false;
+    }
+    if ((now - last_edge) >= STATIC_TIMEOUT) {
+        static_input(pin_state);
+        rise_valid = false;
+        fall_valid = false;
+        last_edge = now - STATIC_TIMEOUT;       // don't let the difference wrap
+    }
+}
+
+// Duty cycle -> lowest bin whose window contains it.
+//
+// Windows overlap only with their neighbours, so the highest bin
+// containing a duty cycle is at most one above this.
+//
+struct BinTable {
+    unsigned char bin[101];
+};
+
+constexpr BinTable
+make_bins()
+{
+    BinTable table {};
+
+    for (auto duty = 0U; duty <= 100; duty++) {
+        auto bin = 0U;
+        while ((bin < MAX) && (windows[bin][1] < duty)) {
+            bin++;
+        }
+        table.bin[duty] = bin;
+    }
+    return table;
+}
+
+constexpr BinTable bins = make_bins();
+
+// Resolve a duty cycle to a cooling level, relative to the current
+// level. Stays put while the duty cycle is inside the current window,
+// otherwise moves to the nearest bin whose window contains it; the
+// same result as stepping one bin at a time until settled.
+//
 unsigned
-target()
+resolve(unsigned duty, unsigned current)
+{
+    if (duty > 100) {
+        duty = 100;
+    }
+    if ((duty >= windows[current][0]) && (duty <= windows[current][1])) {
+        return current;
+    }
+
+    auto bin = bins.bin[duty];
+    if ((bin < current) && (bin < MAX) && (duty >= windows[bin + 1][0])) {
+        bin++;                                              // moving down, stop at the highest match
+    }
+    return bin;
+}
+
+// Setting change policy
+//
+// The policy runs from the periodic tick() only, so level changes are
+// paced in time: a level is held for at least DWELL_MS, and moves are
+// limited to SLEW_RATE levels per second. Time at a level only counts
+// towards a move up to STEP_MS, so however long a level has been held
+// each move is at most STEP_MS worth of levels. Going OFF is always
+// immediate.
+//
+enum {
+    DWELL_MS = 500,             // minimum time at a level
+    SLEW_RATE = 5,              // maximum levels per second
+    STEP_MS = ((1000 / SLEW_RATE) > DWELL_MS) ? (1000 / SLEW_RATE) : DWELL_MS,
+};
+static_assert((DWELL_MS * SLEW_RATE) >= 1000, "dwell time too short to move at least one level");
+
+unsigned        since_change = STEP_MS;
+unsigned        desired = OFF;
+unsigned        seen_generation;
+
+void
+update()
 {
-    if ((current_target > OFF) &&                           // could we go lower?
-            (duty_cycle < windows[current_target][0])) {        // should we go lower?
-        current_target--;
-    } else if ((current_target < MAX) &&                    // could we go higher?
-               (duty_cycle > windows[current_target][1])) {   // should we go higher?
-        current_target++;
+    // only re-resolve when there is a new measurement, or a new range
+    auto m = read();
+    if ((m.generation != seen_generation) || rescaled) {
+        seen_generation = m.generation;
+        rescaled = false;
+        desired = resolve(scale(m.duty_cycle), current_target);
     }
 
+    if (desired == current_target) {
+        return;
+    }
+    if (desired == OFF) {
+        current_target = OFF;
+        since_change = 0;
+        return;
+    }
+    if (since_change < DWELL_MS) {
+        return;
+    }
+
+    auto steps = since_change * SLEW_RATE / 1000;
+    if (desired > current_target) {
+        current_target = ((desired - current_target) > steps) ? (current_target + steps) : desired;
+    } else {
+        current_target = ((current_target - desired) > steps) ? (current_target - steps) : desired;
+    }
+    since_change = 0;
+}
+
+// Periodic timer callback; ms is the time since the last call.
+//
+void
+tick(unsigned ms)
+{
+    since_change += ms;
+    if (since_change > STEP_MS) {
+        since_change = STEP_MS;
+    }
+    update();
+}
+
+// 0-10 target cooling level, as last decided by tick()
+unsigned
+target()
+{
     return current_target;
 }
+
+// Reset all input state.
+//
+void
+reset()
+{
+    range_low = CURVE_LOW;
+    range_high = CURVE_HIGH;
+    rescaled = false;
+    current_target = OFF;
+    since_change = STEP_MS;
+    desired = OFF;
+    seen_generation = 0;
+    sequence = 0;
+    measurement.duty_cycle = 0;
+    measurement.signal = SIGNAL_LOST;
+    measurement.generation = 0;
+    period_count = 0;
+    period_index = 0;
+    samples = 0;
+    count = 0;
+    last_state = false;
+    period_started = false;
+    raw_history = 0;
+    sample_bits = 0;
+    sample_bit_count = 0;
+    sample_rising = false;
+    pending_valid = false;
+    rise_valid = false;
+    fall_valid = false;
+    last_edge = 0;
+}
 }
@@ -8,6 +8,9 @@
 # Each bin has a "step down if lower" and "step up if higher" threshold, obviously
 # there is no down for off, or up for max.
 #
+# input.h now evaluates the same curve at compile time; this script is kept
+# for reference and for eyeballing alternative curves.
+#
 def duty(point):
     if (point < 0):
         point = 0
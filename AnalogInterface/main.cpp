@@ -3,7 +3,8 @@
 //
 // Sample the ~40Hz PWM signal generated by the Cool Shirt pump controller
 // and command a Chillout Quantum V3 compressor accordingly. Other compressor
-// models are likely similar, but this is the one we need to talk to.
+// models are likely similar, but this is the one we need to talk to; build
+// with CHILLOUT_PROFILE=Pro for the 9600bps units.
 //
 // The controller generates a very low duty cycle (~1%) at minimum setting,
 // so it is possible to distinguish between "off" and "minimum".
@@ -12,18 +13,51 @@
 // =====================
 //
 // Core/AHB clock: 24MHz
-// UART: RS-485
-// Timer0: input poll @ 1kHz
-// Timer1: inline delays
+// UART: RS-485, interrupt-driven receive
+// SCT: input edge capture @ 1MHz (INPUT_CAPTURE)
+// Timer0: input idle check @ 100Hz (INPUT_CAPTURE) or input poll @ 1kHz
+// Timer1: RS-485 transmit guard time (unless RS485_HARDWARE_OE) and retry backoff
 // Timer2: LED flash
 // Timer3: receive timeout
 //
+// Between interrupts the core sleeps; all of the work is prompted by
+// either a received byte (UART) or a Timer0 tick, which also bounds how
+// late the main loop notices Timer3 expiring.
+//
 
 #define RXD     P0_0    // RS-485 receive
 #define TXD     P0_4    // RS-485 send
-#define RXTX    P0_1    // RS-485 transciever control: low = receive, high = send
+#define RXTX    P0_1    // RS-485 transciever control: low = receive, high = send (U0_RTS with RS485_HARDWARE_OE)
 #define IN      P0_2    // Input current sensor: low = no current, high = current
 #define LED     P0_3    // LED: low = on, high = off
+#define IN_PIN  2       // IN as a switch matrix pin number
+
+// Measure the input using SCT edge capture rather than polling
+#ifndef INPUT_CAPTURE
+# define INPUT_CAPTURE  1
+#endif
+
+// Find the compressor's serial speed rather than assuming the profile's.
+// Off by default until a linked build has shown that it fits in the
+// LPC810's 4KB of flash alongside everything else.
+#ifndef AUTOBAUD
+# define AUTOBAUD       0
+#endif
+
+// Learn the controller's range from a knob sweep at power-up, and keep
+// it in flash
+#ifndef CALIBRATION
+# define CALIBRATION    1
+#endif
+
+// Hold commands until the bus is predicted to be idle; needs the SCT
+// clock, so only with INPUT_CAPTURE. Off by default, as for AUTOBAUD.
+#ifndef BUS_SCHEDULE
+# define BUS_SCHEDULE   0
+#endif
+#if BUS_SCHEDULE && !INPUT_CAPTURE
+# error BUS_SCHEDULE requires INPUT_CAPTURE
+#endif
 
 #include <sysctl.h>
 #include <pin.h>
@@ -35,13 +69,84 @@
 #include "chillout.h"
 #include "rs485.h"
 #include "statusled.h"
+#include "commander.h"
+#if CALIBRATION
+# include "calibration.h"
+# include "iap.h"
+#endif
+#if INPUT_CAPTURE
+# include "capture.h"
+#endif
+#if AUTOBAUD
+# include "autobaud.h"
+#endif
+#if BUS_SCHEDULE
+# include "schedule.h"
+#endif
 
 extern "C" int main();
 
+#if CALIBRATION
+// Calibration record, alone in its own flash page so that it can be
+// rewritten. Erased/invalid contents leave the default range in place.
+//
+// A const volatile object would be placed in RAM, so the record itself
+// is plain const in a .rodata section (i.e. flash), and is only read
+// through a volatile reference so that the compiler can't assume it
+// still holds its initial zeros.
+const Calibration::Record calibration_flash
+__attribute__((section(".rodata.calibration"), aligned(IAP::PAGE_SIZE))) = {};
+const volatile Calibration::Record &calibration_record = calibration_flash;
+#endif
+
+#if INPUT_CAPTURE
+void
+capture_tick()
+{
+    Input::capture_tick(IN, Capture::now());
+    Input::tick(10);
+#if CALIBRATION
+    Calibration::tick(10, Input::read());
+#endif
+    Chillout::tick(10);
+}
+#else
 void
 sample_tick()
 {
-   Input::sample(IN);
+    static unsigned ms;
+
+    Input::sample_packed(IN);
+    if (++ms >= 32) {
+        ms = 0;
+        Input::tick(32);
+#if CALIBRATION
+        Calibration::tick(32, Input::read());
+#endif
+        Chillout::tick(32);
+    }
+}
+#endif
+
+#if BUS_SCHEDULE
+void
+bus_frame(uint8_t address, unsigned bytes)
+{
+    Schedule::frame(address, bytes, Capture::now());
+}
+#endif
+
+// Is this a good moment to start sending cmd?
+//
+bool
+bus_clear(const Chillout::Command *cmd)
+{
+#if BUS_SCHEDULE
+    return (Chillout::parse_state == Chillout::WAIT_HEADER)
+           && Schedule::clear_to_send(Capture::now(), sizeof(cmd->bytes));
+#else
+    return true;
+#endif
 }
 
 void
@@ -55,17 +160,44 @@ main()
 {
     Sysctl::init_24MHz();
 
+    // WFI enters sleep mode; the deeper modes would stop the UART, SCT and
+    // timers that wake us.
+    SCB->SCR &= ~SCB_SCR_SLEEPDEEP_Msk;
+    LPC_PMU->PCON = 0;
+
     // Make reset pin work for easier in-system flashing.
     RST.enable();
 
     // Setup input pin
     IN.configure(Pin::Input, Pin::PullDown);
 
+#if CALIBRATION
+    // Apply any saved controller calibration.
+    Calibration::load(calibration_record);
+#endif
+
+    // Timer0 reads the measurement that the SCT handler publishes, and
+    // Timer1 shares the transmit state with the UART handler; neither
+    // pair may preempt the other, so all run at the same priority
+    // (Capture::init sets the SCT's).
+    NVIC_SetPriority(MRT_IRQn, IRQ_PRIORITY);
+    NVIC_SetPriority(UART0_IRQn, IRQ_PRIORITY);
+
     // Serial interface up.
     RS485::init();
+#if BUS_SCHEDULE
+    Chillout::frame_hook = bus_frame;
+#endif
 
+#if INPUT_CAPTURE
+    // Capture input edges, with a 10ms timer callback to catch
+    // a static input and pace setting changes.
+    Capture::init(IN_PIN, Input::edge);
+    Timer0.configure(capture_tick, MSEC(10), Timer::periodic);
+#else
     // 1ms timer callback to sample input.
     Timer0.configure(sample_tick, MSEC(1), Timer::periodic);
+#endif
 
     // Turn on the LED
     LED.configure(Pin::Output, Pin::PushPull).set(0);
@@ -74,21 +206,39 @@ main()
     Timer2.configure(led_tick, MSEC(125), Timer::periodic);
 
     // main loop
+    const Chillout::Command *pending = nullptr;
+    unsigned in_flight = Chillout::SET_NONE;
+    unsigned tx_seen = 0;
     for (;;) {
         unsigned c;
 
-        // Poll for status packet bytes; once a packet has been completely received
-        // use the idle window to possibly send an update to adjust the compressor
-        // settings.
+        // Drain received status packet bytes; once a packet has been completely received
+        // work out whether an update is needed to adjust the compressor settings.
         //
-        if (RS485::recv(c)) {
+        while (RS485::recv(c)) {
             if (Chillout::recv(c)) {
 
-                // compressor needs update to match input?
-                RS485::send(Chillout::update_command(Input::target()));
+                // compressor needs update to match input? Hold the current
+                // setting if the input isn't a signal we understand; a lost
+                // input reads as 0% and turns the compressor off. Repeats
+                // are paced while the compressor catches up, and anything
+                // not sent by the next status frame is superseded.
+                auto input = Input::read();
+                pending = nullptr;
+                if (input.signal != Input::SIGNAL_FREQUENCY) {
+                    pending = Commander::next(Input::target(), Chillout::uptime);
+                }
 
-                // update LED
-                if (Chillout::mode & Chillout::MODE_ON) {
+                // update LED; a calibration sweep only shows once the knob
+                // has been turned down, not on every power-up at max
+#if CALIBRATION
+                if (Calibration::sweeping()) {
+                    StatusLED::mode = StatusLED::CALIBRATE;
+                } else
+#endif
+                if (input.signal != Input::SIGNAL_OK) {
+                    StatusLED::mode = StatusLED::NO_INPUT;
+                } else if (Chillout::mode & Chillout::MODE_ON) {
                     StatusLED::mode = StatusLED::ON;
                 } else {
                     StatusLED::mode = StatusLED::OFF;
@@ -99,9 +249,62 @@ main()
             }
         }
 
+        // Send the pending command in the next idle window
+        if (pending && bus_clear(pending) && RS485::send(pending)) {
+            in_flight = Commander::chosen;
+            pending = nullptr;
+        }
+
+        // Pace repeats from when a command actually went out; one that
+        // was dropped after collisions is simply chosen again.
+        if (RS485::tx_complete != tx_seen) {
+            tx_seen = RS485::tx_complete;
+            Commander::sent(in_flight, Chillout::uptime);
+            in_flight = Chillout::SET_NONE;
+        }
+
+#if AUTOBAUD
+        // Keep trying rates until one yields valid frames
+        if (Autobaud::poll(Chillout::uptime)) {
+            RS485::set_rate(Autobaud::rate());
+# if BUS_SCHEDULE
+            Schedule::set_rate(Autobaud::rate());
+# endif
+        }
+#endif
+
+#if CALIBRATION
+        // Save a newly-completed calibration; the source is static, as the
+        // top of the stack is borrowed by the ROM while it copies.
+        if (Calibration::state == Calibration::COMPLETE) {
+            static Calibration::Record r;
+            r = Calibration::record();
+            IAP::write_page(&calibration_record, &r);
+            Calibration::state = Calibration::IDLE;
+        }
+#endif
+
         // Check for comms timeout
         if (Timer3.expired()) {
             StatusLED::mode = StatusLED::ERROR;
+#if AUTOBAUD
+            // maybe the compressor has been swapped; search again
+            if (Autobaud::locked) {
+                Autobaud::restart(Chillout::uptime);
+            }
+#endif
+        }
+
+        // Nothing more to do until the next interrupt. A command waiting
+        // for a gap on the bus doesn't need us awake: the SCT and Timer0
+        // wake the core at least every 10ms, and bus_clear() is checked
+        // again each time round. Interrupts are held off across the check
+        // so that one arriving just before the WFI still wakes it; its
+        // handler runs once they are re-enabled.
+        __disable_irq();
+        if (RS485::rx_buffer.count() == 0) {
+            __WFI();
         }
+        __enable_irq();
     }
 }
@@ -0,0 +1,60 @@
+#pragma once
+#include <stdint.h>
+
+// Single-producer, single-consumer byte queue, safe between one
+// interrupt handler and the main loop without disabling interrupts.
+//
+// head is only written by the producer and tail only by the consumer;
+// both free-run and are masked on use, so SIZE must be a power of two
+// no larger than 128. The buffer holds SIZE bytes.
+//
+template<unsigned SIZE>
+struct Ring {
+    static_assert((SIZE > 0) && (SIZE <= 128) && ((SIZE & (SIZE - 1)) == 0), "ring size must be a power of two, at most 128");
+
+    volatile uint8_t    buf[SIZE];
+    volatile uint8_t    head;
+    volatile uint8_t    tail;
+
+    // Producer side; false if the ring is full and c was dropped.
+    //
+    bool
+    push(uint8_t c)
+    {
+        uint8_t h = head;
+
+        if ((uint8_t)(h - tail) >= SIZE) {
+            return false;
+        }
+        buf[h & (SIZE - 1)] = c;
+        head = h + 1;
+        return true;
+    }
+
+    // Consumer side; false if the ring is empty.
+    //
+    bool
+    pop(uint8_t &c)
+    {
+        uint8_t t = tail;
+
+        if (t == head) {
+            return false;
+        }
+        c = buf[t & (SIZE - 1)];
+        tail = t + 1;
+        return true;
+    }
+
+    unsigned
+    count() const
+    {
+        return (uint8_t)(head - tail);
+    }
+
+    void
+    clear()
+    {
+        tail = head;
+    }
+};
@@ -2,47 +2,329 @@
 #pragma once
 
 #include <uart.h>
+#include <interrupt.h>
 #include "defs.h"
+#include "ring.h"
+
+// Let the USART drive the transceiver direction (RXTX) itself as its
+// RS-485 output enable, rather than switching it by hand with guard
+// delays either side of each command. Off by default: the OESEL/OEPOL/
+// OETA bits are documented for later LPC8xx parts, and this hasn't yet
+// been tried on an LPC810.
+#ifndef RS485_HARDWARE_OE
+# define RS485_HARDWARE_OE 0
+#endif
 
 namespace RS485
 {
+// Received bytes are moved out of the UART by its interrupt handler, so
+// nothing is lost while the main loop is busy (or sending); the main
+// loop drains them with recv().
+//
+enum {
+    RX_BUFFER = 32,                 // a couple of frames
+    STAT_RXRDY = (1U << 0),
+    STAT_OVERRUN = (1U << 8),
+};
+
+Ring<RX_BUFFER> rx_buffer;
+unsigned rx_overruns;               // bytes lost, in hardware or to a full buffer
+
+enum {
+    CFG_ENABLE = (1U << 0),
+    CFG_OETA = (1U << 18),          // OE held for one bit time after the last stop bit
+    CFG_OESEL = (1U << 20),         // RTS output is the RS-485 output enable
+    CFG_OEPOL = (1U << 21),         // ... active high
+};
+
+// (Re)configure the UART at the given speed.
+//
+void
+configure(unsigned baud)
+{
+    UART0.configure(baud);
+
+#if RS485_HARDWARE_OE
+    // OE settings can only be changed with the USART disabled
+    LPC_USART0->CFG &= ~CFG_ENABLE;
+    LPC_USART0->CFG |= CFG_OESEL | CFG_OEPOL | CFG_OETA;
+    LPC_USART0->CFG |= CFG_ENABLE;
+#endif
+
+    LPC_USART0->INTENSET = STAT_RXRDY;
+    NVIC_EnableIRQ(UART0_IRQn);
+}
+
 void
 init()
 {
 	// UART setup
 	UART0_RXD.claim_pin(RXD);
 	UART0_TXD.claim_pin(TXD);
-	UART0.configure(115200);        // XXX autobaud? other versions use 9600bps
+	configure(Chillout::Profile::BAUD);
 
+#if RS485_HARDWARE_OE
+	// Transceiver direction follows the USART's output enable;
+	// receiving whenever it isn't sending.
+	UART0_RTS.claim_pin(RXTX);
+#else
 	// Turn on the RS-485 receiver
 	RXTX.configure(Pin::Output, Pin::PushPull).set(0);
+#endif
+}
+
+// Change speed, e.g. when searching for the compressor's rate.
+//
+void
+set_rate(unsigned baud)
+{
+    configure(baud);
+    rx_buffer.clear();
 }
 
 bool
 recv(unsigned &c)
 {
-    return UART0.recv(c);
+    uint8_t b;
+
+    if (rx_buffer.pop(b)) {
+        c = b;
+        return true;
+    }
+    return false;
 }
 
+// Transmit engine
+//
+// send() takes a copy of the command and returns at once; the rest is
+// driven by interrupts:
+//
+//  TX_GUARD_ON     RXTX asserted, Timer1 running out the guard time
+//  TX_SENDING      TXRDY interrupt feeds the UART one byte at a time
+//  TX_DRAINING     waiting for TXIDLE, i.e. the last stop bit to go
+//  TX_GUARD_OFF    Timer1 again, then RXTX released
+//  TX_BACKOFF      collision; Timer1 running out a random delay before
+//                  trying again
+//
+// With RS485_HARDWARE_OE the USART switches RXTX exactly at the start
+// bit and one bit time after the last stop bit, so the guard states
+// are skipped.
+//
+// A send doesn't start while the receiver is mid-byte. With RS485_ECHO
+// every byte sent is also read back and compared; a mismatch, a
+// receive error or a missing echo aborts the attempt. This needs the
+// transceiver's receiver left enabled while driving, which on this
+// board it isn't (/RE is tied to DE), so echo checking is off by
+// default.
+//
+#ifndef RS485_ECHO
+# define RS485_ECHO 0
+#endif
+
+enum {
+    TX_IDLE,
+    TX_GUARD_ON,
+    TX_SENDING,
+    TX_DRAINING,
+    TX_GUARD_OFF,
+    TX_BACKOFF,
+};
+
+enum {
+    STAT_RXIDLE = (1U << 1),
+    STAT_TXRDY = (1U << 2),
+    STAT_TXIDLE = (1U << 3),
+    STAT_RXERRORS = (1U << 13) | (1U << 14) | (1U << 15),  // framing, parity, noise
+};
+
+enum {
+    MAX_ATTEMPTS = 4,
+    BACKOFF_US = 1000,              // first retry within this, doubling each time
+};
+
+volatile unsigned tx_state = TX_IDLE;
+volatile unsigned tx_complete;      // commands fully sent and the bus released
+volatile unsigned tx_collisions;    // attempts abandoned
+volatile unsigned tx_failed;        // commands given up on
+Chillout::Command tx_command;
+unsigned tx_next;
+unsigned tx_echo;                   // bytes read back so far
+unsigned tx_attempt;
+unsigned backoff_seed;              // stirred by received bytes
+
+void tx_timer();
+void tx_collision();
+
+bool
+busy()
+{
+    return tx_state != TX_IDLE;
+}
+
+// Begin an attempt to send tx_command.
+//
+void
+tx_start()
+{
+    tx_next = 0;
+    tx_echo = 0;
+
+    // somebody else talking?
+    if (!(LPC_USART0->STAT & STAT_RXIDLE)) {
+        tx_collision();
+        return;
+    }
+
+#if RS485_HARDWARE_OE
+    tx_state = TX_SENDING;
+    LPC_USART0->INTENSET = STAT_TXRDY;
+#else
+    tx_state = TX_GUARD_ON;
+
+    // switch to claim the line
+    RXTX.set(1);
+    Timer1.configure(tx_timer, USEC(200), Timer::oneshot);
+#endif
+}
+
+// Abandon the current attempt, and retry after a random delay that
+// doubles with each attempt, up to MAX_ATTEMPTS.
+//
 void
+tx_collision()
+{
+    tx_collisions++;
+    LPC_USART0->INTENCLR = STAT_TXRDY | STAT_TXIDLE;
+#if !RS485_HARDWARE_OE
+    RXTX.set(0);
+#endif
+
+    if (++tx_attempt >= MAX_ATTEMPTS) {
+        tx_failed++;
+        tx_state = TX_IDLE;
+        return;
+    }
+
+    backoff_seed = (backoff_seed * 1664525U) + 1013904223U;
+    auto delay = ((backoff_seed >> 16) % (BACKOFF_US << (tx_attempt - 1))) + 1;
+
+    tx_state = TX_BACKOFF;
+    Timer1.configure(tx_timer, USEC(delay), Timer::oneshot);
+}
+
+void
+tx_done()
+{
+    tx_state = TX_IDLE;
+    tx_complete++;
+}
+
+// Start sending a command; false if there's nothing to send or a send
+// is already in progress.
+//
+bool
 send(const Chillout::Command *cmd)
 {
-    if (cmd) {
-        // switch to claim the line
-        RXTX.set(1);
-        Timer1.delay(USEC(200));
+    if ((cmd == nullptr) || busy()) {
+        return false;
+    }
+    tx_command = *cmd;
+    tx_attempt = 0;
+    tx_start();
+    return true;
+}
+
+// Guard time or backoff expired.
+//
+void
+tx_timer()
+{
+    switch (tx_state) {
+#if !RS485_HARDWARE_OE
+    case TX_GUARD_ON:
+        tx_state = TX_SENDING;
+        LPC_USART0->INTENSET = STAT_TXRDY;
+        break;
+
+    case TX_GUARD_OFF:
+        RXTX.set(0);
+        tx_done();
+        break;
+#endif
+
+    case TX_BACKOFF:
+        tx_start();
+        break;
+    }
+}
+
+// Receive side of the UART interrupt, for each byte; false if the byte
+// was our own echo.
+//
+bool
+rx_interrupt(unsigned stat, uint8_t c)
+{
+    backoff_seed += c;
 
-        // send the command
-        for (const auto &c : cmd->bytes) {
-            UART0.send(c);
+#if RS485_ECHO
+    if ((tx_state == TX_SENDING) || (tx_state == TX_DRAINING)) {
+        if ((tx_echo >= tx_next) || (tx_command.bytes[tx_echo++] != c) || (stat & STAT_RXERRORS)) {
+            LPC_USART0->STAT = STAT_RXERRORS;
+            tx_collision();
         }
+        return false;
+    }
+#endif
+    return true;
+}
 
-        // wait for the command to finish sending
-        while (!UART0.txidle());
+// Transmit side of the UART interrupt.
+//
+void
+tx_interrupt(unsigned stat)
+{
+    if ((tx_state == TX_SENDING) && (stat & STAT_TXRDY)) {
+        LPC_USART0->TXDATA = tx_command.bytes[tx_next++];
+        if (tx_next == sizeof(tx_command.bytes)) {
+            LPC_USART0->INTENCLR = STAT_TXRDY;
+            LPC_USART0->INTENSET = STAT_TXIDLE;
+            tx_state = TX_DRAINING;
+        }
+    } else if ((tx_state == TX_DRAINING) && (stat & STAT_TXIDLE)) {
+        LPC_USART0->INTENCLR = STAT_TXIDLE;
+#if RS485_ECHO
+        // the last byte's echo arrives before its stop bit ends
+        if (tx_echo != sizeof(tx_command.bytes)) {
+            tx_collision();
+            return;
+        }
+#endif
+#if RS485_HARDWARE_OE
+        tx_done();
+#else
+        tx_state = TX_GUARD_OFF;
 
-        // and release the line
-        Timer1.delay(USEC(200));
-        RXTX.set(0);
+        // hold the line a little longer before releasing it
+        Timer1.configure(tx_timer, USEC(200), Timer::oneshot);
+#endif
     }
 }
 }
+
+extern "C" void
+UART0_IRQHandler()
+{
+    unsigned stat;
+
+    while ((stat = LPC_USART0->STAT) & RS485::STAT_RXRDY) {
+        uint8_t c = LPC_USART0->RXDATA;
+        if (RS485::rx_interrupt(stat, c) && !RS485::rx_buffer.push(c)) {
+            RS485::rx_overruns++;
+        }
+    }
+    if (stat & RS485::STAT_OVERRUN) {
+        LPC_USART0->STAT = RS485::STAT_OVERRUN;
+        RS485::rx_overruns++;
+    }
+    RS485::tx_interrupt(stat);
+}
@@ -0,0 +1,126 @@
+#pragma once
+#include "chillout.h"
+
+// Bus schedule
+//
+// The compressor sends a status frame every cycle, and other frames
+// (its own address 2 frames, another remote's commands) tend to land at
+// the same point in the cycle each time. Learn the cycle period from
+// the status frames and which parts of it are in use, so that a
+// command can be started only where the bus is predicted to be idle.
+//
+// The cycle is divided into SLOTS slots, counted from the end of the
+// status frame. A slot in which a frame was seen stays busy for
+// SEEN_CYCLES cycles unless it is seen in use again.
+//
+// Times are in µs, from any free-running clock.
+//
+namespace Schedule
+{
+enum {
+    SLOTS = 32,
+    SEEN_CYCLES = 4,
+    MIN_PERIOD_US = 10000,      // believable status frame intervals
+    MAX_PERIOD_US = 2000000,
+    GUARD_US = 500,             // clearance either side of a command
+};
+
+unsigned period;                // cycle period, 0 until learned
+unsigned last_status;           // end of the last status frame
+bool have_status;
+unsigned byte_us = (10 * 1000000 + Chillout::Profile::BAUD - 1) / Chillout::Profile::BAUD;
+uint8_t busy[SLOTS];
+
+// Serial speed changed.
+//
+void
+set_rate(unsigned baud)
+{
+    byte_us = (10 * 1000000 + baud - 1) / baud;
+}
+
+// Slot containing the given time since the end of the status frame.
+//
+unsigned
+slot(unsigned offset)
+{
+    return (offset >= period) ? (SLOTS - 1) : ((offset * SLOTS) / period);
+}
+
+// Note the bus was in use from..to (offsets into the cycle).
+//
+void
+mark(unsigned from, unsigned to)
+{
+    for (auto s = slot(from); s <= slot(to); s++) {
+        busy[s] = SEEN_CYCLES;
+    }
+}
+
+// A frame of the given size finished at time now.
+//
+void
+frame(uint8_t address, unsigned bytes, unsigned now)
+{
+    auto duration = bytes * byte_us;
+
+    if (address == Chillout::ADDRESS_STATUS) {
+        if (have_status) {
+            auto interval = now - last_status;
+
+            if ((interval >= MIN_PERIOD_US) && (interval <= MAX_PERIOD_US)) {
+                period = (period == 0) ? interval : ((period * 7) + interval) / 8;
+            } else {
+                // lost track; start again
+                period = 0;
+                for (auto &b : busy) {
+                    b = 0;
+                }
+            }
+
+            // age out slots that haven't been used lately
+            for (auto &b : busy) {
+                if (b > 0) {
+                    b--;
+                }
+            }
+        }
+        last_status = now;
+        have_status = true;
+
+        // the status frame itself fills the end of the cycle
+        if (period > duration) {
+            mark(period - duration, period - 1);
+        }
+    } else if (have_status && (period != 0)) {
+        auto end = now - last_status;
+        mark((end > duration) ? (end - duration) : 0, end);
+    }
+}
+
+// Could a command of the given size be started at time now without
+// running into traffic? Until the cycle has been learned, assume the
+// bus is free right after a status frame, as it usually is.
+//
+bool
+clear_to_send(unsigned now, unsigned bytes)
+{
+    if (period == 0) {
+        return true;
+    }
+
+    auto from = now - last_status;
+    auto to = from + (bytes * byte_us) + GUARD_US;
+    if (to >= period) {
+        return false;
+    }
+    from = (from > GUARD_US) ? (from - GUARD_US) : 0;
+
+    for (auto s = slot(from); s <= slot(to); s++) {
+        if (busy[s]) {
+            return false;
+        }
+    }
+    return true;
+}
+}
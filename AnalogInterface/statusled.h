@@ -5,6 +5,8 @@ namespace StatusLED
 // LED bit patterns; LSB to MSB, one bit per tick.
 enum {
     ERROR = 0x55,
+    NO_INPUT = 0x0f,
+    CALIBRATE = 0x07,
     OFF = 0x01,
     ON = 0xff,
 };
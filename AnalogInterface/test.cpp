@@ -1,96 +1,815 @@
 #define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
 #include "doctest.h"
+#include <chrono>
+#include <cstring>
+#include <random>
+#include <vector>
 #include "input.h"
+#include "calibration.h"
 #include "chillout.h"
+#include "autobaud.h"
+#include "ring.h"
+#include "schedule.h"
+#include "commander.h"
+
+// Synthetic PWM input; level at time t (us) for a given frequency and
+// duty cycle (percent).
+//
+static bool
+pwm_level(unsigned t, unsigned hz, unsigned duty)
+{
+    auto period = 1000000U / hz;
+    return (t % period) < (period * duty / 100);
+}
+
+// Run a PWM waveform through the polled sampler, starting at t (us) and
+// stepping from duty_from to duty_to at the rising edge at t_change.
+// Returns the time taken for duty_cycle to settle within tolerance of
+// duty_to, and checks that it stays there.
+//
+static unsigned
+polled_settle(unsigned hz, unsigned duty_from, unsigned duty_to, unsigned tolerance)
+{
+    auto period = 1000000U / hz;
+    auto t_change = 20 * period;
+    auto t_settled = 0U;
+
+    for (auto t = 0U; t < 40 * period; t += Input::SAMPLE_US) {
+        auto duty = (t < t_change) ? duty_from : duty_to;
+        Input::sample(pwm_level(t, hz, duty));
+
+        auto error = (int)Input::read().duty_cycle - (int)duty;
+        auto in_tolerance = (unsigned)((error < 0) ? -error : error) <= tolerance;
+        if (t < t_change) {
+            if (t > 4 * period) {
+                CHECK(in_tolerance);
+            }
+        } else if (!in_tolerance) {
+            t_settled = 0;
+        } else if (t_settled == 0) {
+            t_settled = t;
+        }
+    }
+    REQUIRE(t_settled >= t_change);
+    return t_settled - t_change;
+}
+
+// Tick the change policy until the target reaches the level the
+// current measurement resolves to.
+//
+static unsigned
+settled_target()
+{
+    Input::tick(0);
+    for (auto ms = 0U; Input::target() != Input::desired; ms += 10) {
+        REQUIRE(ms < 10000);
+        Input::tick(10);
+    }
+    return Input::target();
+}
+
+// As for polled_settle, but using the edge capture path.
+//
+static unsigned
+capture_settle(unsigned hz, unsigned duty_from, unsigned duty_to)
+{
+    auto period = 1000000U / hz;
+    auto t_change = 20 * period;
+    auto t_settled = 0U;
+
+    for (auto t = 0U; t < 40 * period; t += period) {
+        auto duty = (t < t_change) ? duty_from : duty_to;
+        Input::edge(true, t);
+        Input::edge(false, t + period * duty / 100);
+
+        if (t < t_change) {
+            if (t > 4 * period) {
+                CHECK(Input::read().duty_cycle == duty);
+            }
+        } else if (Input::read().duty_cycle != duty) {
+            t_settled = 0;
+        } else if (t_settled == 0) {
+            t_settled = t;
+        }
+    }
+    REQUIRE(t_settled >= t_change);
+    return t_settled - t_change;
+}
 
 TEST_CASE("Input") {
-    // reset the input parser
-    Input::current_target = Input::OFF;
-    Input::samples = 0;
-    Input::count = 0;
-    Input::duty_cycle = 0;
+    Input::reset();
 
     SUBCASE("sample increments state") {
         Input::sample(false);
         Input::sample(true);
-        CHECK(Input::count == 1);
-        CHECK(Input::samples == 2);
+        if (Input::GLITCH_SAMPLES == 0) {
+            CHECK(Input::count == 1);
+            CHECK(Input::samples == 1); // rising edge started a new period
+            Input::sample(true);
+            Input::sample(false);
+            CHECK(Input::count == 2);
+            CHECK(Input::samples == 3);
+        } else {
+            CHECK(Input::count == 0);   // single high sample is a glitch
+            CHECK(Input::samples == 2);
+            Input::sample(true);
+            CHECK(Input::count == 1);
+            CHECK(Input::samples == 1); // rising edge started a new period
+            Input::sample(true);
+            Input::sample(false);
+            Input::sample(false);
+            CHECK(Input::count == 3);
+            CHECK(Input::samples == 4);
+        }
     }
 
     SUBCASE("zero duty cycle") {
+        Input::tick(0);
         CHECK(Input::target() == Input::OFF);
         for (auto i = 0U; i < 1000; i++) {
             Input::sample(false);
         }
-        CHECK(Input::duty_cycle == 0);
+        CHECK(Input::read().duty_cycle == 0);
+        Input::tick(0);
         CHECK(Input::target() == Input::OFF);
     }
 
     SUBCASE("100%% duty cycle") {
+        Input::tick(0);
         CHECK(Input::target() == Input::OFF);
         for (auto i = 0U; i < 1000; i++) {
             Input::sample(true);
         }
-        CHECK(Input::duty_cycle == 100);
-        CHECK(Input::target() == Input::MIN);
-        CHECK(Input::target() == (Input::MIN + 1));
-        CHECK(Input::target() == (Input::MIN + 2));
-        CHECK(Input::target() == (Input::MIN + 3));
-        CHECK(Input::target() == (Input::MIN + 4));
-        CHECK(Input::target() == (Input::MIN + 5));
-        CHECK(Input::target() == (Input::MIN + 6));
-        CHECK(Input::target() == (Input::MIN + 7));
-        CHECK(Input::target() == (Input::MIN + 8));
-        CHECK(Input::target() == (Input::MAX));
-        CHECK(Input::target() == (Input::MAX));
+        CHECK(Input::read().duty_cycle == 100);
+        CHECK(settled_target() == Input::MAX);
+        CHECK(Input::target() == Input::MAX);
     }
 
     SUBCASE("50%% duty cycle") {
+        Input::tick(0);
         CHECK(Input::target() == Input::OFF);
         for (auto i = 0U; i < 1000; i += 2) {
             Input::sample(true);
             Input::sample(false);
         }
-        CHECK(Input::duty_cycle == 50); 
-        CHECK(Input::target() == Input::MIN);
-        CHECK(Input::target() == (Input::MIN + 1));
-        CHECK(Input::target() == (Input::MIN + 2));
-        CHECK(Input::target() == (Input::MIN + 3));
+        CHECK(Input::read().duty_cycle == 50); 
+        CHECK(settled_target() == (Input::MIN + 3));
         CHECK(Input::target() == (Input::MIN + 3));
     }
     SUBCASE("target downward") {
         for (auto i = 0U; i < 1000; i++) {
             Input::sample(true);
         }
-        CHECK(Input::duty_cycle == 100);
-        CHECK(Input::target() == Input::MIN);
-        CHECK(Input::target() == (Input::MIN + 1));
-        CHECK(Input::target() == (Input::MIN + 2));
-        CHECK(Input::target() == (Input::MIN + 3));
-        CHECK(Input::target() == (Input::MIN + 4));
-        CHECK(Input::target() == (Input::MIN + 5));
-        CHECK(Input::target() == (Input::MIN + 6));
-        CHECK(Input::target() == (Input::MIN + 7));
-        CHECK(Input::target() == (Input::MIN + 8));
-        CHECK(Input::target() == Input::MAX);
+        CHECK(Input::read().duty_cycle == 100);
+        CHECK(settled_target() == Input::MAX);
         for (auto i = 0U; i < 1000; i++) {
             Input::sample(false);
         }
-        CHECK(Input::duty_cycle == 0);
-        CHECK(Input::target() == (Input::MIN + 8));
-        CHECK(Input::target() == (Input::MIN + 7));
-        CHECK(Input::target() == (Input::MIN + 6));
-        CHECK(Input::target() == (Input::MIN + 5));
-        CHECK(Input::target() == (Input::MIN + 4));
-        CHECK(Input::target() == (Input::MIN + 3));
+        CHECK(Input::read().duty_cycle == 0);
+        Input::tick(0);
+        CHECK(Input::target() == Input::OFF);
+        CHECK(Input::target() == Input::OFF);
+    }
+
+    SUBCASE("measurement snapshot") {
+        auto m = Input::read();
+        CHECK(m.generation == 0);
+        CHECK(m.signal == Input::SIGNAL_LOST);
+
+        Input::publish(50, Input::SIGNAL_OK);
+        m = Input::read();
+        CHECK(m.duty_cycle == 50);
+        CHECK(m.signal == Input::SIGNAL_OK);
+        CHECK(m.generation == 1);
+        CHECK(Input::sequence == 2);
+
+        // tick() resolves a fresh measurement once
+        Input::tick(0);
+        CHECK(Input::seen_generation == 1);
+        CHECK(Input::desired == (Input::MIN + 3));
+        CHECK(settled_target() == (Input::MIN + 3));
+        CHECK(Input::seen_generation == 1);
+
+        // an unchanged measurement isn't a new one
+        Input::publish(50, Input::SIGNAL_OK);
+        CHECK(Input::read().generation == 1);
+        CHECK(Input::sequence == 2);
+
+        // but a new controller range is
+        Input::set_range(40, 100);
+        Input::tick(0);
+        CHECK(Input::desired == (Input::MIN + 1));
+    }
+
+    SUBCASE("static input publishes once") {
+        auto t = 0U;
+        for (auto i = 0U; i < 100; i++) {
+            t += 10000;
+            Input::capture_tick(true, t);
+        }
+        CHECK(Input::read().duty_cycle == 100);
+        CHECK(Input::read().generation == 1);
+
+        for (auto i = 0U; i < 100; i++) {
+            t += 10000;
+            Input::capture_tick(false, t);
+        }
+        CHECK(Input::read().duty_cycle == 0);
+        CHECK(Input::read().generation == 2);
+    }
+
+    SUBCASE("generated windows") {
+        // as previously generated by interpolate.py
+        const unsigned legacy[Input::MAX + 1][2] = {
+            {0, 1}, {2, 18}, {15, 34}, {31, 48}, {45, 60}, {58, 71},
+            {69, 80}, {79, 88}, {86, 93}, {92, 98}, {97, 100}
+        };
+        for (auto level = 0U; level <= Input::MAX; level++) {
+            CAPTURE(level);
+            CHECK(Input::windows[level][0] == legacy[level][0]);
+            CHECK(Input::windows[level][1] == legacy[level][1]);
+        }
+    }
+
+    SUBCASE("target hysteresis") {
+        Input::current_target = Input::MIN + 2;     // 31..48
+        Input::publish(32, Input::SIGNAL_OK);
+        Input::tick(0);
         CHECK(Input::target() == (Input::MIN + 2));
+        Input::publish(30, Input::SIGNAL_OK);
+        Input::tick(0);
         CHECK(Input::target() == (Input::MIN + 1));
-        CHECK(Input::target() == Input::MIN);
+        Input::tick(Input::DWELL_MS);
+        Input::publish(33, Input::SIGNAL_OK);
+        Input::tick(0);
+        CHECK(Input::target() == (Input::MIN + 1));
+        Input::publish(35, Input::SIGNAL_OK);
+        Input::tick(0);
+        CHECK(Input::target() == (Input::MIN + 2));
+    }
+
+    SUBCASE("change policy") {
+        Input::publish(50, Input::SIGNAL_OK);
+        CHECK(settled_target() == (Input::MIN + 3));
+
+        // held for the dwell time
+        Input::publish(100, Input::SIGNAL_OK);
+        for (auto ms = 0U; ms < (Input::DWELL_MS - 10); ms += 10) {
+            Input::tick(10);
+            CHECK(Input::target() == (Input::MIN + 3));
+        }
+
+        // then moves no faster than the slew rate
+        const auto steps = Input::DWELL_MS * Input::SLEW_RATE / 1000;
+        static_assert((Input::DWELL_MS * Input::SLEW_RATE / 1000) < (Input::MAX - Input::MIN - 3), "slew limit must apply");
+        Input::tick(10);
+        CHECK(Input::target() == (Input::MIN + 3 + steps));
+
+        auto ms = 0U;
+        while (Input::target() != Input::MAX) {
+            Input::tick(10);
+            ms += 10;
+            REQUIRE(ms < 10000);
+        }
+        CHECK(ms >= ((Input::MAX - Input::MIN - 3 - steps) * 1000 / Input::SLEW_RATE));
+
+        // off is immediate
+        Input::publish(0, Input::SIGNAL_OK);
+        Input::tick(1);
         CHECK(Input::target() == Input::OFF);
+
+        // and the slew rate limits a move after a short dwell
+        Input::since_change = Input::DWELL_MS;
+        Input::publish(100, Input::SIGNAL_OK);
+        Input::tick(0);
+        CHECK(Input::target() == steps);
+    }
+
+    SUBCASE("slew from a settled level") {
+        // held at OFF for well over a full sweep's worth of time
+        Input::publish(0, Input::SIGNAL_OK);
+        for (auto ms = 0U; ms < 3000; ms += 10) {
+            Input::tick(10);
+        }
         CHECK(Input::target() == Input::OFF);
+
+        // the first move is one step's worth, and the rest keep to the rate
+        const auto steps = Input::STEP_MS * Input::SLEW_RATE / 1000;
+        Input::publish(100, Input::SIGNAL_OK);
+        Input::tick(10);
+        CHECK(Input::target() == steps);
+
+        auto ms = 0U;
+        while (Input::target() != Input::MAX) {
+            Input::tick(10);
+            ms += 10;
+            CHECK(Input::target() <= (steps + ms * Input::SLEW_RATE / 1000));
+            REQUIRE(ms < 10000);
+        }
+        CHECK(ms >= ((Input::MAX - steps) * 1000 / Input::SLEW_RATE));
+    }
+
+    SUBCASE("resolve matches single-stepping") {
+        for (auto current = (unsigned)Input::OFF; current <= Input::MAX; current++) {
+            for (auto duty = 0U; duty <= 100; duty++) {
+                auto stepped = current;
+                for (auto i = 0U; i < Input::MAX; i++) {
+                    if ((stepped > Input::OFF) && (duty < Input::windows[stepped][0])) {
+                        stepped--;
+                    } else if ((stepped < Input::MAX) && (duty > Input::windows[stepped][1])) {
+                        stepped++;
+                    }
+                }
+                CAPTURE(current);
+                CAPTURE(duty);
+                CHECK(Input::resolve(duty, current) == stepped);
+            }
+        }
+    }
+
+    SUBCASE("edge capture") {
+        // 40Hz, 1.5% duty cycle
+        auto t = 0xffff0000U;       // exercise counter wrap
+        for (auto i = 0U; i < 4; i++) {
+            Input::edge(true, t);
+            Input::edge(false, t + 375);
+            t += 25000;
+        }
+        CHECK(Input::read().duty_cycle == 2);
+
+        // 37Hz, 75% duty cycle
+        for (auto i = 0U; i < 4; i++) {
+            Input::edge(true, t);
+            Input::edge(false, t + 20270);
+            t += 27027;
+        }
+        CHECK(Input::read().duty_cycle == 75);
+
+        // falling edge without a preceding rise is ignored
+        Input::rise_valid = false;
+        Input::edge(false, t + 100);
+        Input::edge(true, t + 200);
+        Input::edge(true, t + 300);
+        CHECK(Input::read().duty_cycle == 75);
+    }
+
+    SUBCASE("period-synchronous polled estimate") {
+        for (auto hz : {37U, 40U, 43U}) {
+            CAPTURE(hz);
+            auto period = 1000000U / hz;
+
+            // Error is bounded by one sample of quantisation at each end of
+            // the averaging window, and the window is whole periods, so there
+            // is no beat against the sample block.
+            // The glitch filter adds a sample of delay.
+            auto tolerance = (2 * Input::SAMPLE_US * 100) / (Input::AVERAGE_PERIODS * period) + 1;
+            auto settle = Input::AVERAGE_PERIODS * period + (1 + Input::GLITCH_SAMPLES) * Input::SAMPLE_US;
+            CHECK(polled_settle(hz, 20, 80, tolerance) <= settle);
+            CHECK(polled_settle(hz, 80, 35, tolerance) <= settle);
+            CHECK(polled_settle(hz, 50, 90, tolerance) <= settle);
+        }
+    }
+
+    SUBCASE("packed sampling matches per-sample") {
+        unsigned expected[64];
+
+        for (auto hz : {37U, 40U, 43U}) {
+            CAPTURE(hz);
+            Input::reset();
+            for (auto i = 0U; i < 64 * 32; i++) {
+                Input::sample(pwm_level(i * Input::SAMPLE_US, hz, (i < 1000) ? 30 : 85));
+                if ((i % 32) == 31) {
+                    expected[i / 32] = Input::read().duty_cycle;
+                }
+            }
+
+            Input::reset();
+            for (auto i = 0U; i < 64 * 32; i++) {
+                Input::sample_packed(pwm_level(i * Input::SAMPLE_US, hz, (i < 1000) ? 30 : 85));
+                if ((i % 32) == 31) {
+                    CHECK(Input::read().duty_cycle == expected[i / 32]);
+                }
+            }
+        }
+
+        // static input is still detected
+        Input::reset();
+        for (auto i = 0U; i < 256; i++) {
+            Input::sample_packed(true);
+        }
+        CHECK(Input::read().duty_cycle == 100);
+        for (auto i = 0U; i < 256; i++) {
+            Input::sample_packed(false);
+        }
+        CHECK(Input::read().duty_cycle == 0);
+    }
+
+    SUBCASE("polled extremes") {
+        // the knob's minimum and maximum; one-sample pulses are real here
+        const auto hz = 40U;
+        const auto period = 1000000U / hz;
+        const auto tolerance = (2 * Input::SAMPLE_US * 100) / (Input::AVERAGE_PERIODS * period) + 1;
+
+        for (auto duty : {2U, 3U, 4U, 5U, 95U, 96U, 97U, 98U}) {
+            CAPTURE(duty);
+            for (auto packed : {false, true}) {
+                CAPTURE(packed);
+                Input::reset();
+                for (auto i = 0U; i < 20 * period / Input::SAMPLE_US; i++) {
+                    auto level = pwm_level(i * Input::SAMPLE_US, hz, duty);
+                    if (packed) {
+                        Input::sample_packed(level);
+                    } else {
+                        Input::sample(level);
+                    }
+                }
+                auto m = Input::read();
+                auto error = (int)m.duty_cycle - (int)duty;
+                CHECK(m.signal == Input::SIGNAL_OK);
+                CHECK((unsigned)((error < 0) ? -error : error) <= tolerance);
+                CHECK(Input::resolve(m.duty_cycle, Input::OFF) != Input::OFF);
+            }
+        }
+    }
+
+    SUBCASE("period-synchronous capture estimate") {
+        for (auto hz : {37U, 40U, 43U}) {
+            CAPTURE(hz);
+            auto period = 1000000U / hz;
+
+            // Edge capture is exact, and settles as soon as the averaging
+            // window contains only new periods.
+            CHECK(capture_settle(hz, 20, 80) <= Input::AVERAGE_PERIODS * period);
+            CHECK(capture_settle(hz, 80, 35) <= Input::AVERAGE_PERIODS * period);
+            CHECK(capture_settle(hz, 2, 100 - 2) <= Input::AVERAGE_PERIODS * period);
+        }
+    }
+
+    SUBCASE("edge capture timeout") {
+        Input::edge(true, 0);
+        Input::edge(false, 12500);
+        Input::edge(true, 25000);
+        Input::edge(false, 37500);
+        Input::edge(true, 50000);
+        CHECK(Input::read().duty_cycle == 50);
+        CHECK(Input::read().signal == Input::SIGNAL_OK);
+
+        Input::capture_tick(true, 50000 + Input::STATIC_TIMEOUT - 1);
+        CHECK(Input::read().duty_cycle == 50);
+        Input::capture_tick(true, 50000 + Input::STATIC_TIMEOUT);
+        CHECK(Input::read().duty_cycle == 100);
+        CHECK(Input::read().signal == Input::SIGNAL_OK);
+        Input::capture_tick(false, 0x80000000U);
+        CHECK(Input::read().duty_cycle == 0);
+        CHECK(Input::read().signal == Input::SIGNAL_LOST);
+        CHECK(Input::rise_valid == false);
+    }
+
+    SUBCASE("signal loss") {
+        // 40Hz 60%, then unplugged; detected within two periods plus
+        // one 10ms timer tick
+        auto t = 0U;
+        for (; t < 500000; t += 1000) {
+            if (t < 200000) {
+                auto phase = t % 25000;
+                if (phase == 0) {
+                    Input::edge(true, t);
+                } else if (phase == 15000) {
+                    Input::edge(false, t);
+                }
+            }
+            if ((t % 10000) == 0) {
+                Input::capture_tick(pwm_level(t, 40, 60) && (t < 200000), t);
+            }
+            if (t < 200000) {
+                if (t > 50000) {
+                    CHECK(Input::read().signal == Input::SIGNAL_OK);
+                }
+            } else if (Input::read().signal == Input::SIGNAL_LOST) {
+                break;
+            }
+        }
+        CHECK(Input::read().signal == Input::SIGNAL_LOST);
+        CHECK(Input::read().duty_cycle == 0);
+        CHECK((t - 200000) <= (2 * 25000 + 10000));
+
+        // polled paths, unplugged at every point in the packed word
+        for (auto packed : {false, true}) {
+            for (auto start = 1000U; start < 1032; start++) {
+                CAPTURE(packed);
+                CAPTURE(start);
+                Input::reset();
+                auto sample = packed ? Input::sample_packed : Input::sample;
+                for (auto i = 0U; i < start; i++) {
+                    sample(pwm_level(i * Input::SAMPLE_US, 40, 60));
+                }
+                CHECK(Input::read().signal == Input::SIGNAL_OK);
+                auto n = 0U;
+                while ((Input::read().signal == Input::SIGNAL_OK) && (n < 1000)) {
+                    sample(false);
+                    n++;
+                }
+                CHECK(Input::read().signal == Input::SIGNAL_LOST);
+                CHECK(n <= (2 * 25 + Input::GLITCH_SAMPLES));
+            }
+        }
+    }
+
+    SUBCASE("glitch rejection") {
+        std::mt19937 rng(1234);
+        const auto hz = 40U;
+        const auto duty = 25U;
+        const auto period = 1000000U / hz;
+        const auto bin = Input::resolve(duty, Input::OFF);
+
+        // edge capture: random pulses shorter than GLITCH_US, clear of
+        // the real edges
+        std::uniform_int_distribution<unsigned> width(1, Input::GLITCH_US - 1);
+        std::uniform_int_distribution<unsigned> offset(Input::GLITCH_US * 2, period - Input::GLITCH_US * 3);
+        for (auto t = 0U; t < 200 * period; t += period) {
+            auto fall = t + period * duty / 100;
+
+            Input::edge(true, t);
+            for (auto i = 0U; i < 3; i++) {
+                auto g = t + offset(rng);
+                auto w = width(rng);
+                if ((g + w + Input::GLITCH_US) < fall) {
+                    Input::edge(false, g);          // low glitch while high
+                    Input::edge(true, g + w);
+                } else if (g > (fall + Input::GLITCH_US)) {
+                    Input::edge(true, g);           // high glitch while low
+                    Input::edge(false, g + w);
+                }
+            }
+            Input::edge(false, fall);
+            Input::capture_tick(false, fall + Input::GLITCH_US);
+
+            if (t > (2 * period)) {
+                CHECK(Input::read().duty_cycle == duty);
+                CHECK(Input::resolve(Input::read().duty_cycle, bin) == bin);
+                CHECK(Input::read().signal == Input::SIGNAL_OK);
+            }
+        }
+
+        // polled: random single-sample flips, at least three samples apart
+        // and at least two clear of a real edge (closer than that, the
+        // majority vote can't tell them from the signal); only filtered
+        // when GLITCH_US is at least a sample
+        if (Input::GLITCH_SAMPLES == 0) {
+            return;
+        }
+        Input::reset();
+        std::uniform_int_distribution<unsigned> gap(3, 12);
+        auto next_glitch = gap(rng);
+        for (auto i = 2U; i < 20000; i++) {
+            auto level = pwm_level(i * Input::SAMPLE_US, hz, duty);
+            if (i >= next_glitch) {
+                auto clear = true;
+                for (auto j = i - 2; j <= (i + 2); j++) {
+                    clear = clear && (pwm_level(j * Input::SAMPLE_US, hz, duty) == level);
+                }
+                if (clear) {
+                    level = !level;
+                    next_glitch = i + gap(rng);
+                }
+            }
+            Input::sample_packed(level);
+            if (i > (2 * period / Input::SAMPLE_US)) {
+                CHECK(Input::resolve(Input::read().duty_cycle, bin) == bin);
+            }
+        }
+    }
+
+    SUBCASE("signal frequency") {
+        for (auto hz : {20U, 29U, 51U, 80U}) {
+            CAPTURE(hz);
+            auto period = 1000000U / hz;
+            for (auto t = 0U; t < 10 * period; t += period) {
+                Input::edge(true, t);
+                Input::edge(false, t + period / 2);
+            }
+            CHECK(Input::read().signal == Input::SIGNAL_FREQUENCY);
+            CHECK(Input::read().duty_cycle == 50);
+        }
+        for (auto hz : {31U, 40U, 49U}) {
+            CAPTURE(hz);
+            auto period = 1000000U / hz;
+            for (auto t = 0U; t < 10 * period; t += period) {
+                Input::edge(true, t);
+                Input::edge(false, t + period / 2);
+            }
+            CHECK(Input::read().signal == Input::SIGNAL_OK);
+        }
+    }
+}
+
+TEST_CASE("Calibration") {
+    Input::reset();
+    Calibration::state = Calibration::ARMED;
+    Calibration::elapsed = 0;
+
+    auto measure = [](unsigned duty) {
+        Input::Measurement m = {duty, Input::SIGNAL_OK, 0};
+        return m;
+    };
+
+    SUBCASE("not armed without knob at max") {
+        for (auto ms = 0U; ms < Calibration::ENTRY_WINDOW_MS; ms += 10) {
+            Calibration::tick(10, measure(50));
+        }
+        CHECK(Calibration::state == Calibration::IDLE);
+        Calibration::tick(10, measure(100));
+        CHECK(Calibration::state == Calibration::IDLE);
+    }
+
+    SUBCASE("sweep") {
+        Calibration::tick(10, measure(93));
+        CHECK(Calibration::state == Calibration::LEARNING);
+        CHECK(Calibration::sweeping() == false);
+
+        // sweep down to 5% and back up to 93%
+        for (auto duty = 93U; duty > 5; duty--) {
+            Calibration::tick(50, measure(duty));
+            CHECK(Calibration::sweeping() == (duty <= Calibration::MAX_LOW));
+        }
+        for (auto duty = 5U; duty < 93; duty++) {
+            Calibration::tick(50, measure(duty));
+        }
+        auto ms = 0U;
+        while (Calibration::state == Calibration::LEARNING) {
+            Calibration::tick(10, measure(93));
+            ms += 10;
+        }
+        CHECK(Calibration::state == Calibration::COMPLETE);
+        CHECK(ms <= Calibration::SETTLE_MS);
+        CHECK(Input::range_low == 5);
+        CHECK(Input::range_high == 93);
+
+        // the ends of the observed range now reach the ends of the curve
+        CHECK(Input::scale(93) == 100);
+        CHECK(Input::scale(5) == Input::CURVE_LOW);
+        CHECK(Input::scale(0) == 0);
+        CHECK(Input::resolve(Input::scale(93), Input::OFF) == Input::MAX);
+        CHECK(Input::resolve(Input::scale(5), Input::OFF) == Input::MIN);
+        CHECK(Input::resolve(Input::scale(49), Input::OFF) == Input::resolve(50, Input::OFF));
+    }
+
+    SUBCASE("turning down after power-up isn't a sweep") {
+        Calibration::tick(10, measure(90));
+        CHECK(Calibration::state == Calibration::LEARNING);
+        for (auto duty = 90U; duty > 35; duty--) {
+            Calibration::tick(50, measure(duty));
+        }
+        for (auto ms = 0U; ms < Calibration::TIMEOUT_MS; ms += 10) {
+            Calibration::tick(10, measure(35));
+            CHECK(Calibration::sweeping() == false);
+        }
+        CHECK(Calibration::state == Calibration::IDLE);
+        CHECK(Input::range_low == Input::CURVE_LOW);
+        CHECK(Input::range_high == Input::CURVE_HIGH);
+    }
+
+    SUBCASE("sweep must come back to the top") {
+        Calibration::tick(10, measure(95));
+        for (auto duty = 95U; duty > 2; duty--) {
+            Calibration::tick(50, measure(duty));
+        }
+        for (auto ms = 0U; ms < Calibration::TIMEOUT_MS; ms += 10) {
+            Calibration::tick(10, measure(60));
+        }
+        CHECK(Calibration::state == Calibration::IDLE);
+        CHECK(Input::range_low == Input::CURVE_LOW);
+    }
+
+    SUBCASE("incomplete sweep is abandoned") {
+        Calibration::tick(10, measure(100));
+        CHECK(Calibration::state == Calibration::LEARNING);
+        for (auto ms = 0U; ms < Calibration::TIMEOUT_MS; ms += 10) {
+            Calibration::tick(10, measure(100 - ((ms / 1000) % 20)));
+        }
+        CHECK(Calibration::state == Calibration::IDLE);
+        CHECK(Input::range_low == Input::CURVE_LOW);
+        CHECK(Input::range_high == Input::CURVE_HIGH);
+    }
+
+    SUBCASE("record") {
+        Calibration::Record r {};
+        CHECK(Calibration::load(r) == false);
+
+        Input::range_low = 4;
+        Input::range_high = 96;
+        r = Calibration::record();
+        Input::reset();
+        CHECK(Calibration::load(r) == true);
+        CHECK(Input::range_low == 4);
+        CHECK(Input::range_high == 96);
+
+        r.high = 97;
+        Input::reset();
+        CHECK(Calibration::load(r) == false);
+        CHECK(Input::range_high == Input::CURVE_HIGH);
+    }
+}
+
+TEST_CASE("Input sampling benchmark") {
+    // Host-side comparison of the per-tick cost of the two polled
+    // sampling paths over one minute of 40Hz input; run with -s to
+    // see the results.
+    const auto ticks = 60U * 1000U;
+    const auto rounds = 20U;
+    auto levels = new bool[ticks];
+    for (auto i = 0U; i < ticks; i++) {
+        levels[i] = pwm_level(i * Input::SAMPLE_US, 40, 60);
+    }
+
+    auto time = [&](void (*fn)(bool)) {
+        Input::reset();
+        auto start = std::chrono::steady_clock::now();
+        for (auto r = 0U; r < rounds; r++) {
+            for (auto i = 0U; i < ticks; i++) {
+                fn(levels[i]);
+            }
+        }
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        return std::chrono::duration<double, std::nano>(elapsed).count() / (ticks * rounds);
+    };
+
+    auto per_sample = time(Input::sample);
+    CHECK(Input::read().duty_cycle == 60);
+    auto packed = time(Input::sample_packed);
+    CHECK(Input::read().duty_cycle == 60);
+
+    MESSAGE("sample(): " << per_sample << "ns/sample, sample_packed(): " << packed << "ns/sample");
+    delete[] levels;
+}
+
+// Feed a byte sequence to the Chillout parser, return the number of
+// status frames completed.
+//
+static unsigned
+feed(std::initializer_list<unsigned> bytes)
+{
+    auto frames = 0U;
+    for (auto c : bytes) {
+        if (Chillout::recv(c)) {
+            frames++;
+        }
+    }
+    return frames;
+}
+
+TEST_CASE("Chillout CRC benchmark") {
+    // Host-side per-byte cost of the two CRC table variants; run with
+    // -s to see the results.
+    const auto bytes = 1000000U;
+    auto data = new uint8_t[bytes];
+    for (auto i = 0U; i < bytes; i++) {
+        data[i] = (i * 131) ^ (i >> 7);
+    }
+
+    auto time = [&](uint8_t (*fn)(uint8_t, uint8_t)) {
+        uint8_t crc = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (auto i = 0U; i < bytes; i++) {
+            crc = fn(crc, data[i]);
+        }
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        return std::make_pair(crc, std::chrono::duration<double, std::nano>(elapsed).count() / bytes);
+    };
+
+    auto table8 = time(Chillout::CRC8<8>::update);
+    auto table4 = time(Chillout::CRC8<4>::update);
+    CHECK(table8.first == table4.first);
+
+    MESSAGE("256-entry table: " << table8.second << "ns/byte, 16-entry table: " << table4.second << "ns/byte");
+    delete[] data;
+}
+
+// Commands as printed by generate.py, for the Quantum V3
+//
+static_assert(std::is_same<Chillout::Profile, Chillout::QuantumV3>::value, "tests assume the Quantum V3 profile");
+static_assert(Chillout::Pro::BAUD == 9600, "Pro differs in speed");
+
+constexpr bool
+same(const Chillout::Command &a, std::initializer_list<uint8_t> b)
+{
+    auto i = 0U;
+    for (auto c : b) {
+        if (a.bytes[i++] != c) {
+            return false;
+        }
     }
+    return i == sizeof(a.bytes);
 }
 
+static_assert(same(Chillout::cmd_table[Chillout::SET_OFF], {0xc0, 0x08, 0x03, 0x00, 0x00, 0x0a, 0x00, 0x6b, 0x01}), "off");
+static_assert(same(Chillout::cmd_table[Chillout::SET_ON], {0xc0, 0x08, 0x03, 0x03, 0x00, 0x0a, 0x00, 0x51, 0x01}), "on");
+static_assert(same(Chillout::cmd_table[Chillout::SET_ON + 1], {0xc0, 0x08, 0x03, 0x03, 0x00, 0x0a, 0x01, 0x56, 0x01}), "set 10");
+static_assert(same(Chillout::cmd_table[Chillout::SET_ON + 4], {0xc0, 0x08, 0x03, 0x03, 0x00, 0x07, 0x01, 0xbf, 0x01}), "set 7");
+static_assert(same(Chillout::cmd_table[Chillout::SET_ON + 10], {0xc0, 0x08, 0x03, 0x03, 0x00, 0x01, 0x01, 0xc1, 0x01}), "set 1");
+static_assert(same(Chillout::command<Chillout::POWER_ECO, 10, Chillout::CHANGE_POWER>, {0xc0, 0x08, 0x03, 0x01, 0x00, 0x0a, 0x00, 0x7d, 0x01}), "eco");
+static_assert(same(Chillout::command<Chillout::POWER_ECO, 1>, {0xc0, 0x08, 0x03, 0x01, 0x00, 0x01, 0x01, 0xed, 0x01}), "eco set 1");
+
 TEST_CASE("Chillout") {
     Chillout::mode = 0;
     Chillout::parse_state = Chillout::WAIT_HEADER;
@@ -113,28 +832,16 @@ TEST_CASE("Chillout") {
         CHECK(Chillout::recv(0xff) == false);
         CHECK(Chillout::parse_state == Chillout::WAIT_HEADER);
 
-        CHECK(Chillout::recv(0xc0) == false);
-        CHECK(Chillout::parse_state == Chillout::WAIT_LENGTH);
-        CHECK(Chillout::recv(0x0e) == false);
-        CHECK(Chillout::parse_state == Chillout::WAIT_ADDRESS);
-        CHECK(Chillout::recv(0x01) == false);
-        CHECK(Chillout::parse_state == Chillout::WAIT_MODE);
-        CHECK(Chillout::recv(0xff) == false);
+        // invalid mode; frame is delimited by its length and rejected
+        CHECK(feed({0xc0, 0x0e, 0x01, 0xff, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xc2, 0x01}) == 0);
         CHECK(Chillout::parse_state == Chillout::WAIT_HEADER);
 
-        CHECK(Chillout::recv(0xc0) == false);
-        CHECK(Chillout::parse_state == Chillout::WAIT_LENGTH);
-        CHECK(Chillout::recv(0x0e) == false);
-        CHECK(Chillout::parse_state == Chillout::WAIT_ADDRESS);
-        CHECK(Chillout::recv(0x01) == false);
-        CHECK(Chillout::parse_state == Chillout::WAIT_MODE);
-        CHECK(Chillout::recv(0x00) == false);
-        CHECK(Chillout::recv(0x00) == false);
-        CHECK(Chillout::recv(0x00) == false);
-        CHECK(Chillout::parse_state == Chillout::WAIT_SETPOINT);
-        CHECK(Chillout::recv(0x00) == false);
+        // invalid setpoint
+        CHECK(feed({0xc0, 0x0e, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x30, 0x01}) == 0);
+        CHECK(feed({0xc0, 0x0e, 0x01, 0x00, 0x00, 0x00, 0x0b, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xbc, 0x01}) == 0);
         CHECK(Chillout::parse_state == Chillout::WAIT_HEADER);
 
+        // bad trailer
         CHECK(Chillout::recv(0xc0) == false);
         CHECK(Chillout::parse_state == Chillout::WAIT_LENGTH);
         CHECK(Chillout::recv(0x0e) == false);
@@ -153,9 +860,11 @@ TEST_CASE("Chillout") {
         CHECK(Chillout::recv(0x00) == false);
         CHECK(Chillout::recv(0x00) == false);
         CHECK(Chillout::recv(0x00) == false);
+        CHECK(Chillout::parse_state == Chillout::WAIT_TRAILER);
         CHECK(Chillout::recv(0x00) == false);
         CHECK(Chillout::parse_state == Chillout::WAIT_HEADER);
 
+        // good frame
         CHECK(Chillout::recv(0xc0) == false);
         CHECK(Chillout::parse_state == Chillout::WAIT_LENGTH);
         CHECK(Chillout::recv(0x0e) == false);
@@ -173,11 +882,188 @@ TEST_CASE("Chillout") {
         CHECK(Chillout::recv(0x00) == false);
         CHECK(Chillout::recv(0x00) == false);
         CHECK(Chillout::recv(0x00) == false);
-        CHECK(Chillout::recv(0x00) == false);
+        CHECK(Chillout::recv(0xef) == false);
         CHECK(Chillout::recv(0x01) == true);
         CHECK(Chillout::parse_state == Chillout::WAIT_HEADER);
     }
 
+    SUBCASE("other addresses") {
+        // address 2 frames of any length are delimited and skipped whole,
+        // even when they contain header bytes
+        CHECK(feed({0xc0, 0x0a, 0x02, 0xc0, 0x0e, 0x01, 0x00, 0x00, 0x00, 0x34, 0x01}) == 0);
+        CHECK(Chillout::parse_state == Chillout::WAIT_HEADER);
+        CHECK(feed({0xc0, 0x14, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+                    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xea, 0x01}) == 0);
+        CHECK(Chillout::parse_state == Chillout::WAIT_HEADER);
+
+        // remote command frames are decoded but don't count as status
+        CHECK(feed({0xc0, 0x08, 0x03, 0x03, 0x00, 0x05, 0x01, 0x95, 0x01}) == 0);
+        CHECK(Chillout::remote_mode == 0x03);
+        CHECK(Chillout::remote_setting == 0x05);
+
+        // a status frame straight after
+        CHECK(feed({0xc0, 0x0e, 0x01, 0x03, 0x00, 0x00, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x31, 0x01}) == 1);
+        CHECK(Chillout::mode == 0x03);
+        CHECK(Chillout::setting == 9);
+
+        // oversize length
+        CHECK(feed({0xc0, Chillout::MAX_FRAME, 0x02}) == 0);
+        CHECK(Chillout::parse_state == Chillout::WAIT_HEADER);
+    }
+
+    SUBCASE("telemetry") {
+        Chillout::telemetry = {};
+        Chillout::uptime = 1234;
+
+        // the header's example frame
+        CHECK(feed({0xc0, 0x0e, 0x01, 0x00, 0x08, 0x00, 0x02, 0x07, 0x8e, 0x00, 0x02, 0x00, 0x00, 0x84, 0x01}) == 1);
+        CHECK(Chillout::telemetry.power == 0x00);
+        CHECK(Chillout::telemetry.setpoint == 0x02);
+        CHECK(Chillout::telemetry.coolant == 1934);
+        CHECK(Chillout::telemetry.rpm == 0);
+        CHECK(Chillout::telemetry.timestamp == 1234);
+        CHECK(Chillout::telemetry.frames == 1);
+
+        // off-in-max, sub-zero coolant, running compressor
+        uint8_t f[] = {0xc0, 0x0e, 0x01, 0x02, 0x00, 0x00, 0x05, 0xff, 0x9c, 0x00, 0x00, 0x0b, 0xb8, 0x00, 0x01};
+        f[13] = Chillout::checksum(Chillout::ADDRESS_STATUS, &f[3], 10);
+        Chillout::tick(10);
+        for (auto c : f) {
+            Chillout::recv(c);
+        }
+        CHECK(Chillout::telemetry.power == 0x02);
+        CHECK(Chillout::telemetry.setpoint == 0x05);
+        CHECK(Chillout::telemetry.coolant == -100);
+        CHECK(Chillout::telemetry.rpm == 3000);
+        CHECK(Chillout::telemetry.timestamp == 1244);
+        CHECK(Chillout::telemetry.frames == 2);
+
+        // rejected frames leave it alone
+        f[6] = 0x0b;
+        f[13] = Chillout::checksum(Chillout::ADDRESS_STATUS, &f[3], 10);
+        for (auto c : f) {
+            Chillout::recv(c);
+        }
+        CHECK(Chillout::telemetry.setpoint == 0x05);
+        CHECK(Chillout::telemetry.frames == 2);
+    }
+
+    SUBCASE("commands") {
+        // every command the builder makes is a valid remote frame
+        for (auto power : {Chillout::POWER_OFF, Chillout::POWER_ECO, Chillout::POWER_MAX}) {
+            for (auto setpoint = 1U; setpoint <= 10; setpoint++) {
+                auto c = Chillout::make_command(power, setpoint, Chillout::CHANGE_SETPOINT);
+                CHECK(c.bytes[7] == Chillout::checksum(Chillout::ADDRESS_REMOTE, &c.bytes[3], 4));
+                for (auto b : c.bytes) {
+                    Chillout::recv(b);
+                }
+                CHECK(Chillout::remote_mode == power);
+                CHECK(Chillout::remote_setting == setpoint);
+            }
+        }
+
+        // whichever way they're made, the commands match the table
+        for (auto cmd = (unsigned)Chillout::SET_OFF; cmd <= (Chillout::SET_ON + Input::MAX); cmd++) {
+            auto c = Chillout::command_for(cmd);
+            CHECK(memcmp(c->bytes, Chillout::cmd_table[cmd].bytes, sizeof(c->bytes)) == 0);
+        }
+        CHECK(Chillout::command_for(Chillout::SET_NONE) == nullptr);
+
+        constexpr auto eco = Chillout::command<Chillout::POWER_ECO, 5>;
+        CHECK(eco.bytes[3] == Chillout::POWER_ECO);
+        CHECK(eco.bytes[5] == 5);
+        CHECK(eco.bytes[6] == Chillout::CHANGE_SETPOINT);
+    }
+
+    SUBCASE("checksum") {
+        // known-good vectors; generate.py's "off" command and a captured
+        // status frame
+        const uint8_t off[] = {0x00, 0x00, 0x0a, 0x00};
+        const uint8_t status[] = {0x00, 0x08, 0x00, 0x02, 0x07, 0x8e, 0x00, 0x02, 0x00, 0x00};
+        CHECK(Chillout::checksum(Chillout::ADDRESS_REMOTE, off, sizeof(off)) == 0x6b);
+        CHECK(Chillout::checksum(Chillout::ADDRESS_STATUS, status, sizeof(status)) == 0x84);
+
+        // both table variants agree
+        for (auto crc = 0U; crc < 256; crc++) {
+            for (auto c = 0U; c < 256; c += 7) {
+                CHECK(Chillout::CRC8<4>::update(crc, c) == Chillout::CRC8<8>::update(crc, c));
+            }
+        }
+
+        // a corrupted frame is counted and rejected
+        Chillout::crc_errors = 0;
+        CHECK(feed({0xc0, 0x0e, 0x01, 0x00, 0x08, 0x00, 0x02, 0x07, 0x8e, 0x00, 0x02, 0x00, 0x00, 0x84, 0x01}) == 1);
+        CHECK(feed({0xc0, 0x0e, 0x01, 0x01, 0x08, 0x00, 0x02, 0x07, 0x8e, 0x00, 0x02, 0x00, 0x00, 0x84, 0x01}) == 0);
+        CHECK(Chillout::crc_errors == 1);
+        CHECK(Chillout::mode == 0);
+        CHECK(Chillout::setting == 9);
+    }
+
+    SUBCASE("resynchronisation") {
+        // a header as the failing byte starts the next frame
+        CHECK(feed({0xc0, 0x0e, 0x01, 0x03, 0x00}) == 0);
+        CHECK(feed({0xc0, 0x0e, 0x01, 0x03, 0x00, 0x00, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x31, 0x01}) == 1);
+        CHECK(Chillout::setting == 9);
+
+        // a truncated frame doesn't take the following frame with it
+        CHECK(feed({0xc0, 0x0e, 0x01, 0x03, 0x00, 0x00, 0x02, 0x00}) == 0);
+        CHECK(feed({0xc0, 0x0e, 0x01, 0x03, 0x00, 0x00, 0x05, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x22, 0x01}) == 1);
+        CHECK(Chillout::setting == 6);
+        CHECK(Chillout::parse_state == Chillout::WAIT_HEADER);
+    }
+
+    SUBCASE("truncation recovery rate") {
+        // Synthetic capture: status, aux and remote frames in the
+        // proportions seen on the bus, with a fraction of frames
+        // truncated at a random point.
+        std::mt19937 rng(4321);
+        std::vector<unsigned> stream;
+        auto intact = 0U;
+        auto truncated = 0U;
+
+        for (auto n = 0U; n < 2000; n++) {
+            std::vector<unsigned> f;
+            auto kind = rng() % 4;
+            if (kind < 2) {
+                f = {0xc0, 0x0e, 0x01, (unsigned)(rng() % 2) * 3, 0x00, 0x02, 1 + (unsigned)(rng() % 10),
+                     (unsigned)(rng() % 256), (unsigned)(rng() % 256), 0x00, 0x02,
+                     (unsigned)(rng() % 256), (unsigned)(rng() % 256), (unsigned)(rng() % 256), 0x01};
+            } else if (kind == 2) {
+                auto length = 6 + (unsigned)(rng() % 12);
+                f = {0xc0, length, 0x02};
+                while (f.size() < length) {
+                    f.push_back(rng() % 256);
+                }
+                f.push_back(0x01);
+            } else {
+                f = {0xc0, 0x08, 0x03, 0x03, 0x00, 1 + (unsigned)(rng() % 10), 0x01, (unsigned)(rng() % 256), 0x01};
+            }
+            uint8_t payload[Chillout::MAX_FRAME];
+            for (unsigned i = Chillout::PAYLOAD; i < (f.size() - 2); i++) {
+                payload[i - Chillout::PAYLOAD] = f[i];
+            }
+            f[f.size() - 2] = Chillout::checksum(f[2], payload, f.size() - Chillout::MIN_LENGTH - 1);
+
+            if ((rng() % 8) == 0) {
+                f.resize(1 + rng() % (f.size() - 1));
+                truncated++;
+            } else if (kind < 2) {
+                intact++;
+            }
+            stream.insert(stream.end(), f.begin(), f.end());
+        }
+
+        auto recovered = 0U;
+        for (auto c : stream) {
+            if (Chillout::recv(c)) {
+                recovered++;
+            }
+        }
+
+        MESSAGE("truncated " << truncated << " frames, recovered " << recovered << " of " << intact << " status frames");
+        CHECK(recovered == intact);
+    }
+
     SUBCASE("parse results") {
         CHECK(Chillout::recv(0xc0) == false);
         CHECK(Chillout::parse_state == Chillout::WAIT_LENGTH);
@@ -196,7 +1082,7 @@ TEST_CASE("Chillout") {
         CHECK(Chillout::recv(0x00) == false);
         CHECK(Chillout::recv(0x00) == false);
         CHECK(Chillout::recv(0x00) == false);
-        CHECK(Chillout::recv(0x00) == false);
+        CHECK(Chillout::recv(0xef) == false);
         CHECK(Chillout::recv(0x01) == true);
         CHECK(Chillout::parse_state == Chillout::WAIT_HEADER);
         CHECK(Chillout::mode == 0);
@@ -222,7 +1108,7 @@ TEST_CASE("Chillout") {
         CHECK(Chillout::recv(0x00) == false);
         CHECK(Chillout::recv(0x00) == false);
         CHECK(Chillout::recv(0x00) == false);
-        CHECK(Chillout::recv(0x00) == false);
+        CHECK(Chillout::recv(0xdb) == false);
         CHECK(Chillout::recv(0x01) == true);
         CHECK(Chillout::parse_state == Chillout::WAIT_HEADER);
         CHECK(Chillout::mode == (Chillout::MODE_ON | Chillout::MODE_MAX));
@@ -233,3 +1119,237 @@ TEST_CASE("Chillout") {
         CHECK(Chillout::update_index(Input::MAX) == (Chillout::SET_ON + 10));
     }
 }
+
+TEST_CASE("Autobaud") {
+    Chillout::parse_state = Chillout::WAIT_HEADER;
+    Autobaud::candidate = 0;
+    Autobaud::restart(0);
+
+    std::initializer_list<unsigned> status = {0xc0, 0x0e, 0x01, 0x03, 0x00, 0x00, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x31, 0x01};
+
+    CHECK(Autobaud::rate() == 115200);
+
+    // nothing heard; move on to the next rate, then wrap
+    CHECK(Autobaud::poll(Autobaud::DWELL_MS - 1) == false);
+    CHECK(Autobaud::poll(Autobaud::DWELL_MS) == true);
+    CHECK(Autobaud::rate() == 9600);
+    CHECK(Autobaud::poll(2 * Autobaud::DWELL_MS) == true);
+    CHECK(Autobaud::rate() == 115200);
+
+    // garbage at the wrong rate doesn't lock
+    std::mt19937 rng(99);
+    for (auto i = 0; i < 1000; i++) {
+        Chillout::recv(rng() % 256);
+    }
+    CHECK(Autobaud::poll(2 * Autobaud::DWELL_MS + 10) == false);
+    CHECK(Autobaud::locked == false);
+
+    // two good frames lock
+    feed(status);
+    CHECK(Autobaud::poll(2 * Autobaud::DWELL_MS + 20) == false);
+    CHECK(Autobaud::locked == false);
+    feed(status);
+    CHECK(Autobaud::poll(2 * Autobaud::DWELL_MS + 30) == false);
+    CHECK(Autobaud::locked == true);
+    CHECK(Autobaud::poll(100 * Autobaud::DWELL_MS) == false);
+    CHECK(Autobaud::rate() == 115200);
+
+    // restarting searches again from the current rate
+    Autobaud::restart(100 * Autobaud::DWELL_MS);
+    CHECK(Autobaud::poll(101 * Autobaud::DWELL_MS) == true);
+    CHECK(Autobaud::rate() == 9600);
+
+    // slow status frames, further apart than the dwell, still lock
+    auto t = 200 * Autobaud::DWELL_MS;
+    Autobaud::restart(t);
+    feed(status);
+    CHECK(Autobaud::poll(t + Autobaud::DWELL_MS) == false);
+    CHECK(Autobaud::poll(t + Autobaud::FRAME_GAP_MS) == false);
+    feed(status);
+    CHECK(Autobaud::poll(t + Autobaud::FRAME_GAP_MS + 10) == false);
+    CHECK(Autobaud::locked == true);
+    CHECK(Autobaud::rate() == 9600);
+
+    // ... but a lone frame isn't held on to forever
+    t += 10 * Autobaud::FRAME_GAP_MS;
+    Autobaud::restart(t);
+    feed(status);
+    CHECK(Autobaud::poll(t + Autobaud::DWELL_MS + Autobaud::FRAME_GAP_MS - 1) == false);
+    CHECK(Autobaud::poll(t + Autobaud::DWELL_MS + Autobaud::FRAME_GAP_MS) == true);
+    CHECK(Autobaud::rate() == 115200);
+}
+
+TEST_CASE("Ring") {
+    Ring<8> r {};
+    uint8_t c;
+
+    CHECK(r.pop(c) == false);
+    CHECK(r.count() == 0);
+
+    // fill, overflow, drain, many times round so the indices wrap
+    for (auto round = 0U; round < 100; round++) {
+        for (auto i = 0U; i < 8; i++) {
+            CHECK(r.push(round + i));
+        }
+        CHECK(r.push(0xff) == false);
+        CHECK(r.count() == 8);
+        for (auto i = 0U; i < 8; i++) {
+            CHECK(r.pop(c));
+            CHECK(c == (uint8_t)(round + i));
+        }
+        CHECK(r.pop(c) == false);
+
+        // and part-full
+        r.push(round);
+        CHECK(r.count() == 1);
+        CHECK(r.pop(c));
+        CHECK(c == (uint8_t)round);
+    }
+
+    r.push(1);
+    r.push(2);
+    r.clear();
+    CHECK(r.count() == 0);
+    CHECK(r.pop(c) == false);
+}
+
+TEST_CASE("Schedule") {
+    Schedule::period = 0;
+    Schedule::have_status = false;
+    for (auto &b : Schedule::busy) {
+        b = 0;
+    }
+    Schedule::set_rate(115200);
+
+    // 100ms cycle; status frame, address 2 frame ending 10ms later,
+    // another remote's command ending 50ms later
+    const auto cycle = 100000U;
+    auto run = [&](unsigned cycles, bool remote) {
+        static unsigned t = 1000000;
+        for (auto n = 0U; n < cycles; n++) {
+            t += cycle;
+            Schedule::frame(Chillout::ADDRESS_STATUS, 15, t);
+            Schedule::frame(Chillout::ADDRESS_AUX, 20, t + 10000);
+            if (remote) {
+                Schedule::frame(Chillout::ADDRESS_REMOTE, 9, t + 50000);
+            }
+        }
+        return t;
+    };
+
+    // nothing learned yet; anything goes
+    CHECK(Schedule::clear_to_send(0, 9));
+
+    auto t = run(10, true);
+    CHECK(Schedule::period == cycle);
+    CHECK(Schedule::clear_to_send(t + 1000, 9) == true);       // after status
+    CHECK(Schedule::clear_to_send(t + 8500, 9) == false);      // address 2
+    CHECK(Schedule::clear_to_send(t + 20000, 9) == true);
+    CHECK(Schedule::clear_to_send(t + 49500, 9) == false);     // remote
+    CHECK(Schedule::clear_to_send(t + 70000, 9) == true);
+    CHECK(Schedule::clear_to_send(t + 99000, 9) == false);     // next status
+    CHECK(Schedule::clear_to_send(t + 150000, 9) == false);    // status overdue
+
+    // the remote goes away; its slot frees up after a few cycles
+    t = run(Schedule::SEEN_CYCLES + 1, false);
+    CHECK(Schedule::clear_to_send(t + 49500, 9) == true);
+    CHECK(Schedule::clear_to_send(t + 8500, 9) == false);
+
+    // a gap in status frames forgets everything
+    t = run(1, false);
+    Schedule::frame(Chillout::ADDRESS_STATUS, 15, t + 5 * Schedule::MAX_PERIOD_US);
+    CHECK(Schedule::period == 0);
+    CHECK(Schedule::clear_to_send(t + 5 * Schedule::MAX_PERIOD_US + 8500, 9));
+
+    // the parser reports frames
+    static unsigned hook_address, hook_bytes;
+    Chillout::parse_state = Chillout::WAIT_HEADER;
+    Chillout::frame_hook = [](uint8_t address, unsigned bytes) {
+        hook_address = address;
+        hook_bytes = bytes;
+    };
+    feed({0xc0, 0x0e, 0x01, 0x03, 0x00, 0x00, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x31, 0x01});
+    Chillout::frame_hook = nullptr;
+    CHECK(hook_address == Chillout::ADDRESS_STATUS);
+    CHECK(hook_bytes == 15);
+}
+
+TEST_CASE("Commander") {
+    Chillout::mode = 0;
+    Chillout::setting = Input::MIN;
+    Commander::outstanding = Chillout::SET_NONE;
+    Commander::acked = 0;
+    Commander::retries = 0;
+
+    auto sent = [](const Chillout::Command *c) {
+        return (c == nullptr) ? -1 : (int)c->bytes[Chillout::Profile::COMMAND_POWER] * 100 + c->bytes[Chillout::Profile::COMMAND_SETPOINT];
+    };
+
+    // pick the next command, and if there is one say it went out at once
+    auto send = [](uint8_t target, unsigned now) {
+        auto c = Commander::next(target, now);
+        if (c != nullptr) {
+            Commander::sent(Commander::chosen, now);
+        }
+        return c;
+    };
+
+    SUBCASE("pacing") {
+        // switch on; not repeated while the compressor catches up
+        CHECK(sent(send(Input::MIN, 0)) == 310);
+        CHECK(send(Input::MIN, 100) == nullptr);
+        CHECK(send(Input::MIN, Commander::SETTLE_MS - 1) == nullptr);
+
+        // ... then at doubling intervals, up to the limit
+        auto t = (unsigned)Commander::SETTLE_MS;
+        CHECK(send(Input::MIN, t) != nullptr);
+        CHECK(send(Input::MIN, t + 2 * Commander::SETTLE_MS - 1) == nullptr);
+        t += 2 * Commander::SETTLE_MS;
+        CHECK(send(Input::MIN, t) != nullptr);
+        t += 4 * Commander::SETTLE_MS;
+        CHECK(send(Input::MIN, t) != nullptr);
+        t += 8 * Commander::SETTLE_MS;
+        CHECK(send(Input::MIN, t) != nullptr);
+        CHECK(Commander::hold_off == Commander::MAX_BACKOFF_MS);
+        t += Commander::MAX_BACKOFF_MS;
+        CHECK(send(Input::MIN, t) != nullptr);
+        CHECK(Commander::hold_off == Commander::MAX_BACKOFF_MS);
+        CHECK(Commander::retries == 5);
+
+        // it comes on at the lowest setting; the setpoint change goes out at once
+        Chillout::mode = Chillout::MODE_ON | Chillout::MODE_MAX;
+        CHECK(sent(send(Input::MIN + 2, t + 10)) == 308);
+        CHECK(Commander::acked == 1);
+
+        // the target moves before that took effect; no waiting
+        CHECK(sent(send(Input::MAX, t + 20)) == 301);
+        CHECK(send(Input::MAX, t + 30) == nullptr);
+
+        // done
+        Chillout::setting = Input::MAX;
+        CHECK(send(Input::MAX, t + 40) == nullptr);
+        CHECK(Commander::acked == 2);
+        CHECK(Commander::outstanding == Chillout::SET_NONE);
+    }
+
+    SUBCASE("first attempt never sent") {
+        // chosen, but superseded or dropped before it went out
+        CHECK(sent(Commander::next(Input::MIN, 0)) == 310);
+        CHECK(Commander::outstanding == Chillout::SET_NONE);
+
+        // still due on the next frame, without waiting for a hold-off
+        CHECK(sent(Commander::next(Input::MIN, 100)) == 310);
+        Commander::sent(Commander::chosen, 150);
+        CHECK(Commander::outstanding == Chillout::SET_ON);
+        CHECK(Commander::retries == 0);
+
+        // the hold-off runs from when it actually went out
+        CHECK(Commander::next(Input::MIN, 150 + Commander::SETTLE_MS - 1) == nullptr);
+        CHECK(Commander::next(Input::MIN, 150 + Commander::SETTLE_MS) != nullptr);
+        CHECK(Commander::hold_off == Commander::SETTLE_MS);
+
+        // nothing chosen, nothing recorded
+        Commander::sent(Chillout::SET_NONE, 200);
+        CHECK(Commander::sent_at == 150);
+    }
+}